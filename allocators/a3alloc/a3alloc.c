@@ -2,227 +2,477 @@
 #define _GNU_SOURCE
 
 #include <assert.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sched.h>
-
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+// per-CPU caches driven by restartable sequences, build with -DA3ALLOC_NO_RSEQ to only use the processor heap locks
+#if defined(__x86_64__) && defined(__linux__) && !defined(A3ALLOC_NO_RSEQ) && __has_include(<sys/rseq.h>)
+#define A3ALLOC_RSEQ
+#include <sys/rseq.h>
+#include <sys/sysinfo.h>
+#endif
+
+#include "a3alloc.h"
 #include "memlib.h"
+#include "mm_lock.h"
 #include "mm_thread.h"
 #include "timer.h"
 
 // #define debug_print(frmt, ...) { printf(frmt, ##__VA_ARGS__); }
 #define debug_print(frmt, ...)
 
-#define PAGES_IN_SUPERBLOCK 2
-
-#define NUM_BLOCK_SIZES 8
-const int BLOCK_SIZES[NUM_BLOCK_SIZES] = { 32, 64, 128, 256, 512, 1024, 2048, 4096 };
+#define PAGES_IN_SUPERBLOCK 2 // minimum superblock size, larger size classes may use more pages
+#define MAX_PAGES_IN_SUPERBLOCK 512
+#define MIN_SUPERBLOCK_BLOCKS 4 // so that medium blocks still share their superblock's header and tail slack
+#define MAX_SUPERBLOCK_BLOCK_SIZE 8192 // larger medium classes are carved as page runs of their own
+#define SUPERBLOCK_HEADER_SIZE 128 // the blocks of a superblock start after its header
+#define SUPERBLOCK_BITMAP_WORDS 8 // enough bits to track every block of the smallest size class
+
+#define NUM_FULLNESS_GROUPS 4 // superblocks are grouped by quarters of fullness
+#define EMPTY_FRACTION 4 // a heap that is more than 1/4 empty...
+#define HEAP_SLACK_SUPERBLOCKS 4 // ...and has more than this many superblocks worth of free blocks gives one up
+
+#define TCACHE_MAGAZINE_SIZE 64 // maximum number of blocks a thread caches per size class...
+#define TCACHE_MAGAZINE_BYTES (16 * 1024) // ...and bytes per size class, so only classes up to 256 bytes get all 64, though never fewer than 2 blocks
+
+#define CPU_CACHE_SIZE 64 // maximum number of blocks a processor caches per small size class
+
+#define EXACT_PAGE_BINS 16 // free runs of up to this many pages are binned by their exact length...
+#define PAGE_BINS_PER_DOUBLING 4 // ...longer ones into 4 bins per doubling of their length
+#define NUM_PAGE_BINS 64 // the last bin also takes every run too long for the others
+
+#define MIN_RESERVE_PAGES 4 // heaps take fresh pages from mem_sbrk in chunks starting at this many pages...
+#define MAX_RESERVE_PAGES 32 // ...and doubling up to this many, so that growing heaps rarely contend on the break
+
+#define DEFAULT_DECAY_MS 10000 // free page runs untouched for this long are given back to the OS
+
+#define ARENA_MIN_CHUNK_PAGES 16 // arenas bump allocate out of chunks starting at this many pages...
+#define ARENA_MAX_CHUNK_PAGES 256 // ...and doubling up to this many, objects over a quarter of that get a chunk of their own
+#define ARENA_ALIGNMENT 16
+
+#define CACHE_MAGAZINE_SIZE 32 // maximum number of constructed objects a processor caches per object cache
+#define CACHE_BATCH_SIZE 16 // number of objects moved between a processor's magazine and the slabs at once
+#define CACHE_MIN_SLAB_OBJECTS 8 // slabs are the smallest power of two pages holding this many objects...
+#define CACHE_MAX_SLAB_PAGES 64 // ...and wasting at most 1/8th of their space, up to this many pages
+#define CACHE_NAME_LENGTH 32
+
+#define PROFILE_DEFAULT_SAMPLE (512 * 1024) // mean number of bytes allocated between two sampled allocations
+#define PROFILE_MAX_DEPTH 32 // frames kept of a sampled allocation's call stack
+#define PROFILE_SKIP_FRAMES 2 // sample_allocation and the mm_ function that called it
+#define PROFILE_STACK_SLOTS (1 << 14) // distinct call stacks a heap profile can hold, samples from further ones are dropped
+#define PROFILE_SAMPLE_SLOTS (1 << 16) // sampled blocks tracked until they are freed, further ones only count as allocated
+
+#define TRACE_RING_SIZE 256 // slow calls a thread's ring holds until they are drained, a power of two
+#define TRACE_CALIBRATION_NS 10000000 // how long timer ticks are counted against the clock to convert them
+
+// size classes are multiples of 16 up to 128, then four classes per doubling up to 256 KB (the same spacing as
+// jemalloc), which bounds the internal fragmentation of a block to 20%. The medium classes above 4096 bytes are
+// served from superblocks like the small ones up to 8 KB and from page runs of one block above that, only requests
+// above 256 KB are large blocks
+#define QUANTUM_SIZE_CLASSES 8
+#define CLASSES_PER_DOUBLING 4
+#define DOUBLING_SIZE_CLASSES(base) (base) + (base) / 4, (base) + (base) / 2, (base) + 3 * (base) / 4, 2 * (base)
+
+#define NUM_BLOCK_SIZES 52
+#define NUM_SMALL_BLOCK_SIZES 28 // classes up to 4096 bytes, the only ones the processor caches hold
+const int BLOCK_SIZES[NUM_BLOCK_SIZES] = {
+	16, 32, 48, 64, 80, 96, 112, 128,
+	DOUBLING_SIZE_CLASSES(128),
+	DOUBLING_SIZE_CLASSES(256),
+	DOUBLING_SIZE_CLASSES(512),
+	DOUBLING_SIZE_CLASSES(1024),
+	DOUBLING_SIZE_CLASSES(2048),
+	DOUBLING_SIZE_CLASSES(4096),
+	DOUBLING_SIZE_CLASSES(8192),
+	DOUBLING_SIZE_CLASSES(16384),
+	DOUBLING_SIZE_CLASSES(32768),
+	DOUBLING_SIZE_CLASSES(65536),
+	DOUBLING_SIZE_CLASSES(131072)
+};
 #define MAX_BLOCK_SIZE (BLOCK_SIZES[NUM_BLOCK_SIZES - 1])
 
 typedef ptrdiff_t vaddr_t;
 
 // forward declare the main structures since they reference each other
 typedef struct superblock_t superblock;
-typedef struct free_block_t free_block;
 typedef struct free_pages_t free_pages;
 typedef struct processor_heap_t processor_heap;
-typedef struct subpage_allocation_t subpage_allocation;
-typedef struct large_allocation_t large_allocation;
-
-struct superblock_t // size will be rounded to nearest block size during initialization
+typedef struct page_map_entry_t page_map_entry;
+typedef struct remote_block_t remote_block;
+typedef struct magazine_t magazine;
+typedef struct size_class_usage_t size_class_usage;
+typedef struct call_counts_t call_counts;
+typedef struct size_class_counts_t size_class_counts;
+typedef struct thread_cache_t thread_cache;
+typedef struct cpu_cache_bin_t cpu_cache_bin;
+typedef struct cpu_cache_t cpu_cache;
+typedef struct arena_chunk_t arena_chunk;
+typedef struct heap_span_t heap_span;
+typedef struct cache_slab_t cache_slab;
+typedef struct cache_magazine_t cache_magazine;
+typedef struct profile_stack_t profile_stack;
+typedef struct profile_sample_t profile_sample;
+typedef struct trace_ring_t trace_ring;
+typedef struct trace_call_t trace_call;
+
+// header at the start of a run of pages holding blocks of a single size class (size = 96 bytes)
+struct superblock_t
 {
 	processor_heap* owner;
-	unsigned int size_in_bytes;
-	free_block* free_block_list[NUM_BLOCK_SIZES];
+	superblock* prev;
 	superblock* next;
+	unsigned short size_class;
+	unsigned short num_pages;
+	unsigned short num_blocks;
+	unsigned short num_free;
+	unsigned long long free_bitmap[SUPERBLOCK_BITMAP_WORDS]; // a set bit marks a free block
 };
 
-struct free_block_t // size = 16 bytes
-{
-	free_block* prev;
-	free_block* next;
-};
-
-struct free_pages_t // size = 24 bytes
+// header at the start of a run of free pages, its first and last pages are also tagged in the page map (size = 40 bytes)
+struct free_pages_t
 {
 	unsigned long long num_pages;
 	free_pages* prev;
 	free_pages* next;
+	double freed_at; // when the run was last freed, only meaningful while it is dirty
+	int is_dirty; // some of the pages after the first may still be resident
 };
 
-struct processor_heap_t
+// blocks of a size class a heap handed out and took back, only updated under the heap lock, so the small
+// classes count the blocks moved by cache refills and flushes rather than mm_malloc and mm_free calls
+struct size_class_counts_t
 {
-	pthread_mutex_t lock;
+	unsigned long long num_refilled;
+	unsigned long long num_flushed;
+};
 
-	superblock* subpage_allocations;
-	// large_allocation* large_allocations;
+struct processor_heap_t
+{
+	mm_lock_t lock;
+
+	// superblocks bucketed by size class and by how full they are, the last group holds the completely full ones
+	superblock* fullness_groups[NUM_BLOCK_SIZES][NUM_FULLNESS_GROUPS + 1];
+	unsigned int group_masks[NUM_BLOCK_SIZES]; // bit g is set when fullness_groups[class][g] is not empty
+	unsigned long long class_masks[NUM_FULLNESS_GROUPS + 1]; // bit c is set when fullness_groups[c][group] is not empty
+	unsigned long long bytes_in_use; // bytes of the blocks handed out from this heap's superblocks
+	unsigned long long bytes_held; // bytes of all the blocks in this heap's superblocks
+	size_class_counts class_counts[NUM_BLOCK_SIZES];
 	
-	free_pages* free_page_list;
+	free_pages* free_page_bins[NUM_PAGE_BINS];
+	unsigned long long page_bin_mask; // bit b is set when free_page_bins[b] is not empty
+	double next_purge; // earliest time a free will scan the bins for decayed runs again
+
+	// fresh pages taken from mem_sbrk but not handed out yet
+	unsigned char* reserve;
+	unsigned long long reserve_pages;
+	unsigned long long next_reserve_pages;
+
+	processor_heap* global; // the global heap this one gives up superblocks to and recycles pages from
+	mm_heap* isolated; // the isolated heap this is a sub-heap of, NULL for the default heaps
+
+	// every run of pages an isolated heap took from mem_sbrk, so destroying it can give them all back at once
+	heap_span* spans;
+	unsigned long long num_spans;
+	unsigned long long max_spans;
+
+	// blocks freed by threads running on other processors, pushed without taking the lock and
+	// drained by the owner on its next allocation (kept on its own cache line since other processors write it)
+	remote_block* remote_frees __attribute__((aligned(64)));
+	unsigned long long num_remote_frees;
 };
 
-// structure at the beginning of every subpage allocation (size = 16 bytes)
-struct subpage_allocation_t
+// out of band metadata for one page of the data segment, so that blocks do not need headers (size = 16 bytes)
+struct page_map_entry_t
 {
-	superblock* owner;
-	unsigned long long size_in_bytes;
+	void* owner; // the superblock containing the page, or the heap owning the large allocation or free run at it
+	unsigned int num_pages; // length of the large allocation starting at the page or of the free run bounded by it, 0 for superblock pages
+	unsigned char is_free; // boundary tag, only set on the first and last page of a free run
+	unsigned char is_sampled; // set on the first page of a large allocation the heap profile tracks
+	unsigned char is_isolated; // set on every page of a superblock of an mm_heap and on the first page of its page run blocks, which bypass the caches
+	unsigned char page_run_class; // size class of the block of a page run class starting at the page, 0 for any other page
 };
 
-// structure at the beginning of every large allocation (size = 16 bytes)
-struct large_allocation_t
+// small block waiting in a heap's remote free list, linked through its first word
+struct remote_block_t
 {
-	processor_heap* owner;
-	unsigned long long size_in_bytes;
+	remote_block* next;
 };
 
-void* page_zero; // page dedicated for heap data
+// bounded stack of blocks of a single size class, holding up to magazine_capacity[size class] rounds
+struct magazine_t
+{
+	unsigned int count;
+	void** rounds;
+};
 
-unsigned int num_processors;
-unsigned int superblock_size;
+// what the allocations of a size class asked for, to report internal fragmentation
+struct size_class_usage_t
+{
+	unsigned long long num_allocations;
+	unsigned long long requested_bytes;
+};
 
-pthread_mutex_t global_heap_lock = PTHREAD_MUTEX_INITIALIZER;
+// calls on the default heaps a thread made for a size class, kept on every call since only that thread writes them
+struct call_counts_t
+{
+	unsigned long long num_allocs;
+	unsigned long long num_frees;
+	unsigned long long num_bytes; // large blocks only: bytes allocated less bytes freed, wraps in a thread freeing others' blocks
+};
 
-processor_heap *processor_heaps;
+// index of the counts of large blocks in thread_cache.calls
+#define LARGE_CALLS NUM_BLOCK_SIZES
 
-void initialize()
+enum thread_cache_state
 {
-	num_processors = getNumProcessors();
-	unsigned int page_size = mem_pagesize();
+	TCACHE_UNINITIALIZED = 0,
+	TCACHE_ACTIVE,
+	TCACHE_DISABLED // the thread is exiting, go straight to the heaps
+};
 
-	superblock_size = PAGES_IN_SUPERBLOCK * page_size;
+// enough rounds for every magazine, the medium classes never hold more than TCACHE_MAGAZINE_BYTES of page-sized blocks
+#define TCACHE_ROUNDS (NUM_SMALL_BLOCK_SIZES * TCACHE_MAGAZINE_SIZE + \
+	(NUM_BLOCK_SIZES - NUM_SMALL_BLOCK_SIZES) * (TCACHE_MAGAZINE_BYTES / 4096))
 
-	page_zero = mem_sbrk(page_size);
-	processor_heaps = (processor_heap*) page_zero;
+// per-thread cache sitting in front of the processor heaps
+struct thread_cache_t
+{
+	enum thread_cache_state state;
+	magazine magazines[NUM_BLOCK_SIZES];
+	void* rounds[TCACHE_ROUNDS]; // carved into the magazines when the thread first uses its cache
+	size_class_usage usage[NUM_BLOCK_SIZES];
+	call_counts calls[NUM_BLOCK_SIZES + 1];
+	thread_cache* prev; // in thread_caches while the cache is active
+	thread_cache* next;
+};
 
-	for(unsigned int i = 0; i < num_processors; i++)
-	{
-		memset(&processor_heaps[i], 0, sizeof(processor_heap));
-		pthread_mutex_init(&processor_heaps[i].lock, NULL);
-	}
-}
+// blocks of a size class cached by a processor, only ever touched from inside a restartable sequence on that processor
+struct cpu_cache_bin_t
+{
+	unsigned int count;
+	void* rounds[CPU_CACHE_SIZE];
+};
 
-processor_heap* get_processor_heap()
+// per-processor cache sitting between the thread caches and the processor heaps
+struct cpu_cache_t
 {
-	return &processor_heaps[sched_getcpu() % num_processors];
-}
+	cpu_cache_bin bins[NUM_SMALL_BLOCK_SIZES];
+};
 
-unsigned int calculate_size_class(size_t sz)
+// run of pages an isolated heap took from mem_sbrk
+struct heap_span_t
 {
-	unsigned int size_class = 0;
-	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
-	{
-		if(sz <= BLOCK_SIZES[i])
-		{
-			size_class = i;
-			break;
-		}
-	}
-	return size_class;
-}
+	unsigned char* start;
+	unsigned long long num_pages;
+};
 
-void insert_free_entry(unsigned int size_class, free_block* block, superblock* super_block)
+// heap created with mm_heap_create, with its own per-processor sub-heaps followed by its own global heap
+struct mm_heap
 {
-	if(super_block->free_block_list[size_class] == NULL)
-	{
-		super_block->free_block_list[size_class] = block;
-	}
-	else
-	{
-		free_block* it = super_block->free_block_list[size_class];
-		while(1)
-		{
-			if((block < it) || (it->next == NULL))
-			{
-				if(block < it)
-				{
-					// link the new block to the previous node
-					if(it->prev != NULL) { it->prev->next = block; }
-					block->prev = it->prev;
-
-					// link the new block to the current node
-					it->prev = block;
-					block->next = it;
-
-					// if the iterator was the first entry, then we need to overwrite it with the new block
-					if(it == super_block->free_block_list[size_class])
-					{
-						super_block->free_block_list[size_class] = block;
-					}
-				}
-				else
-				{
-					it->next = block;
-					block->prev = it;
-				}
+	mm_heap* prev;
+	mm_heap* next;
+	processor_heap heaps[];
+};
 
-				// check if the block can be merged with an adjacent block (only blocks < 4096 bytes can be merged)
-				if(size_class < NUM_BLOCK_SIZES - 1)
-				{
-					unsigned long long prev_diff = (block->prev == NULL) ? 0 : (unsigned char*) block - (unsigned char*) block->prev;
-					unsigned long long next_diff = (block->next == NULL) ? 0 : (unsigned char*) block->next - (unsigned char*) block;
-
-					if(prev_diff == BLOCK_SIZES[size_class])
-					{
-						// remove the blocks from the link
-						if(block->prev->prev != NULL) { block->prev->prev->next = block->next; }
-						if(block->next != NULL) { block->next->prev = block->prev->prev; }
-
-						// if the root of the linked list points to the previous block, point it to the next block
-						if(block->prev == super_block->free_block_list[size_class])
-						{
-							free_block* next = block->next;
-							if(next != NULL) next->prev = NULL;
-							super_block->free_block_list[size_class] = next;
-						}
-						
-						block->prev->prev = NULL;
-						block->prev->next = NULL;
-
-						debug_print("Combining block of size %lli with block of size %i\n", prev_diff, BLOCK_SIZES[size_class]);
-						insert_free_entry(size_class + 1, block->prev, super_block);
-					}
-					else if(next_diff == BLOCK_SIZES[size_class])
-					{
-						// remove the blocks from the link
-						if(block->prev != NULL) { block->prev->next = block->next->next; }
-						if(block->next->next != NULL) { block->next->next->prev = block->prev; }
-
-						// if the root of the linked list points to the current block, point it to the next block
-						if(block == super_block->free_block_list[size_class])
-						{
-							free_block* next = block->next->next;
-							if(next != NULL) next->prev = NULL;
-							super_block->free_block_list[size_class] = next;
-						}
-
-						block->prev = NULL;
-						block->next = NULL;
-
-						debug_print("Combining block of size %lli with block of size %i\n", next_diff, BLOCK_SIZES[size_class]);
-						insert_free_entry(size_class + 1, block, super_block);
-					}
-				}
+enum cache_slab_list
+{
+	SLAB_PARTIAL = 0,
+	SLAB_FULL, // every object is allocated
+	SLAB_EMPTY, // every object is free
+	NUM_SLAB_LISTS
+};
 
-				break;
-			}
+// header of a slab of an object cache, aligned to its size so that objects find it by masking their address
+struct cache_slab_t
+{
+	cache_slab* prev;
+	cache_slab* next;
+	unsigned int list;
+	unsigned int num_free;
+	unsigned short free_stack[]; // indices of the free objects, kept out of the objects so they stay constructed
+};
 
-			it = it->next;
-		}
-	}
-}
+// constructed objects cached by a processor, in front of the cache's slabs
+struct cache_magazine_t
+{
+	mm_lock_t lock;
+	unsigned int count;
+	void* rounds[CACHE_MAGAZINE_SIZE];
+	unsigned long long num_allocs;
+	unsigned long long num_frees;
+} __attribute__((aligned(64)));
+
+// typed object cache created with mm_cache_create, followed by one magazine per processor
+struct mm_cache
+{
+	char name[CACHE_NAME_LENGTH];
+	unsigned long long object_size; // stride of the objects in a slab, the requested size rounded to the alignment
+	unsigned long long slab_size;
+	unsigned int slab_objects;
+	unsigned int slab_header; // offset of the first object in a slab
+	void (*ctor)(void*);
+	void (*dtor)(void*);
+
+	mm_cache* prev;
+	mm_cache* next;
+
+	mm_lock_t lock; // guards the slab lists and counters below
+	cache_slab* slabs[NUM_SLAB_LISTS];
+	unsigned long long num_slabs[NUM_SLAB_LISTS];
+	unsigned long long slabs_created;
+	unsigned long long slabs_destroyed;
+
+	cache_magazine magazines[];
+};
+
+// call stack of sampled allocations, with the sampled bytes allocated from it in total and still live
+struct profile_stack_t
+{
+	unsigned long long hash; // 0 for an unused slot
+	unsigned int depth;
+	void* frames[PROFILE_MAX_DEPTH];
+	unsigned long long alloc_count;
+	unsigned long long alloc_bytes;
+	unsigned long long live_count;
+	unsigned long long live_bytes;
+};
 
-// removes and returns the first entry from the size_class linked list in a given super_block
-free_block* get_free_entry(superblock* super_block, unsigned int size_class)
+// sampled block that has not been freed yet
+struct profile_sample_t
 {
-	free_block* block = super_block->free_block_list[size_class];
-	free_block* next = block->next;
+	void* ptr; // NULL for an unused slot
+	profile_stack* stack;
+	size_t size; // requested size
+};
 
-	if(next != NULL) { next->prev = NULL; }
-	super_block->free_block_list[size_class] = next;
+// slow call events of one thread, only written by the thread that claimed the ring and only drained under
+// trace_drain_lock, rings are never unmapped and get reused once their thread exits
+struct trace_ring_t
+{
+	trace_ring* next;
+	int in_use;
+	unsigned long long head; // events ever written
+	unsigned long long tail; // events ever drained
+	unsigned long long dropped; // events lost to a full ring
+	mm_trace_event_t events[TRACE_RING_SIZE];
+};
 
-	block->next = NULL;
-	block->prev = NULL;
-	return block;
-}
+// where the call a thread is tracing has spent its time so far, phases do not overlap: a nested phase pauses the
+// one it is nested in, and lock waits only count as such
+struct trace_call_t
+{
+	int active;
+	unsigned int walk_length;
+	unsigned int grew;
+	unsigned int phase; // the phase the call is in, MM_TRACE_PHASES outside of all of them
+	unsigned long long switched_at; // ticks when the call entered its phase
+	unsigned long long switched_wait; // the thread's lock wait ticks at that point
+	unsigned long long phase_ticks[MM_TRACE_PHASES + 1];
+};
+
+// header at the start of each chunk of pages an arena allocates out of, the objects carry no header
+struct arena_chunk_t
+{
+	arena_chunk* next;
+};
+
+// region whose objects are all freed at once, only ever used by one thread at a time
+struct mm_arena
+{
+	unsigned char* cursor; // next free byte of the current chunk
+	unsigned char* limit; // end of the current chunk
+	arena_chunk* chunks; // chunks objects are bumped out of, the current one first
+	arena_chunk* large_chunks; // chunks holding a single large object
+	unsigned long long chunk_pages; // length of the next chunk
+};
+
+void* page_zero; // page dedicated for heap data
+
+page_map_entry* page_map; // one entry per page of the data segment, mapped outside of it
+unsigned int page_shift;
+unsigned long long page_map_size; // number of entries in the page map
+unsigned long long huge_page_pages; // pages per transparent huge page when memlib backs the heap with them, else 0
+
+unsigned int num_processors;
+
+unsigned int superblock_pages[NUM_BLOCK_SIZES];
+unsigned int superblock_blocks[NUM_BLOCK_SIZES];
+unsigned int magazine_capacity[NUM_BLOCK_SIZES]; // blocks a thread caches per size class, half of them move at once, 0 for the page run classes
+unsigned int first_page_run_class; // this class and the ones after it are page runs rather than superblock blocks
+unsigned int page_run_pages[NUM_BLOCK_SIZES];
+unsigned long long block_size_reciprocals[NUM_BLOCK_SIZES]; // ceil(2^32 / size), turns block index divisions into multiplies
+
+pthread_mutex_t init_lock = PTHREAD_MUTEX_INITIALIZER;
+int initialized; // set once initialize has run, read without init_lock
+
+processor_heap *processor_heaps;
+processor_heap *global_heap; // holds the superblocks given up by the processor heaps, shared by all of them
+
+mm_heap* isolated_heaps; // every live mm_heap, so that trimming, purging and forking reach their sub-heaps (read without the lock by sized frees)
+mm_lock_t isolated_heaps_lock = MM_LOCK_INITIALIZER;
+
+mm_cache* object_caches; // every live mm_cache, so that trimming and forking reach them
+mm_lock_t object_caches_lock = MM_LOCK_INITIALIZER;
+
+__thread thread_cache tcache;
+
+cpu_cache* cpu_caches; // NULL when the kernel or the C library does not give us restartable sequences
+unsigned int num_cpu_caches;
+pthread_key_t tcache_key; // only used to run flush_thread_cache when a thread exits
+
+// decay policy for free page runs, a negative decay never purges and 0 purges as soon as a run is freed
+double purge_decay = DEFAULT_DECAY_MS / 1000.0;
+int purge_advice = MADV_DONTNEED;
+
+// internal fragmentation report, the thread caches only count usage while fragmentation_report is set
+int fragmentation_report;
+size_class_usage exited_thread_usage[NUM_BLOCK_SIZES]; // usage folded in from the thread caches of exited threads
+mm_lock_t usage_lock = MM_LOCK_INITIALIZER;
+
+// call counts for mm_alloc_stats, also under usage_lock
+thread_cache* thread_caches; // every active thread cache, so that the stats reach their counts and magazines
+call_counts exited_thread_calls[NUM_BLOCK_SIZES + 1]; // counts folded in from the thread caches of exited threads
+
+// heap profile, sampling is off while profile_sample_bytes is 0
+unsigned long long profile_sample_bytes;
+char* profile_path; // where the profile is written at exit, when set
+profile_stack* profile_stacks; // open addressed by stack hash, mapped outside of the data segment
+profile_sample* profile_samples; // open addressed by block address, mapped outside of the data segment
+unsigned long long num_profile_stacks;
+unsigned long long num_profile_samples;
+mm_lock_t profile_lock = MM_LOCK_INITIALIZER;
+
+__thread long long bytes_until_sample; // the allocation taking it below 0 is sampled
+__thread unsigned long long sample_random_state;
+
+// slow call tracing, off while trace_threshold_ticks is 0
+unsigned long long trace_threshold_ticks;
+unsigned long long trace_start_ticks;
+double trace_ticks_per_ns;
+trace_ring* trace_rings; // every ring ever claimed, pushed without a lock
+mm_lock_t trace_drain_lock = MM_LOCK_INITIALIZER;
+
+__thread trace_call traced_call;
+__thread trace_ring* thread_trace_ring;
+
+void flush_thread_cache(void* cache);
+void report_fragmentation(void);
+void* background_purge(void* arg);
+void start_background_purge(void);
+void lock_all_heaps(void);
+void unlock_all_heaps(void);
+void reset_after_fork(void);
+void dump_heap_profile(void);
 
 unsigned long long align(unsigned long long value, unsigned long long alignment)
 {
@@ -230,260 +480,3529 @@ unsigned long long align(unsigned long long value, unsigned long long alignment)
 	return (value + mask) & ~mask;
 }
 
-void* alloc_pages(processor_heap* heap, unsigned int num_pages)
+// fills in the per-class superblock geometry, giving classes whose blocks would leave too much slack more pages
+void initialize_superblock_geometry(unsigned int page_size)
 {
-	void* page = NULL;
-
-	// try to find a page available for reuse
-	for(free_pages* pages = heap->free_page_list; pages != NULL; pages = pages->next)
+	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
 	{
-		if(pages->num_pages > num_pages) // take some of the pages in a free page list
-		{
-			// printf("take some pages!\n");
-			page = pages;
-			pages->num_pages -= num_pages;
+		unsigned int num_pages = align(SUPERBLOCK_HEADER_SIZE + MIN_SUPERBLOCK_BLOCKS * BLOCK_SIZES[i], page_size) / page_size;
+		unsigned int num_blocks = 0;
 
-			unsigned int offset = mem_pagesize() * num_pages;
-			if((pages->next != NULL) && (pages->next->prev != NULL)) {
-				pages->next->prev += offset; // adjust the next free page list pointer to point to the correct pages
-			}
-			memcpy(pages, (unsigned char*) pages + offset, sizeof(free_pages));
+		if(num_pages < PAGES_IN_SUPERBLOCK)
+		{
+			num_pages = PAGES_IN_SUPERBLOCK;
 		}
-		else if(pages->num_pages == num_pages) // take all of the pages in a free page list
+
+		for(; num_pages <= MAX_PAGES_IN_SUPERBLOCK; num_pages++)
 		{
-			// printf("take all pages!\n");
-			page = pages;
+			unsigned int bytes = num_pages * page_size;
+			num_blocks = (bytes - SUPERBLOCK_HEADER_SIZE) / BLOCK_SIZES[i];
 
-			if(pages == heap->free_page_list) // remove the free page list from the head of the list
-			{
-				free_pages* next = heap->free_page_list->next;
-				if(next != NULL) {
-					next->prev = NULL;
-				}
-				heap->free_page_list = next;
-			}
-			else // remove the free page list from inside the list
+			// accept the geometry once at most 1/8th of the superblock is wasted
+			if((bytes - num_blocks * BLOCK_SIZES[i]) * 8 <= bytes)
 			{
-				if(pages->prev != NULL) { pages->prev->next = pages->next; }
-				if(pages->next != NULL) { pages->next->prev = pages->prev; }
+				break;
 			}
 		}
 
-		if(page != NULL)
+		if(num_pages > MAX_PAGES_IN_SUPERBLOCK)
 		{
-			break;
+			num_pages = MAX_PAGES_IN_SUPERBLOCK;
+			num_blocks = (num_pages * page_size - SUPERBLOCK_HEADER_SIZE) / BLOCK_SIZES[i];
 		}
+
+		assert(num_blocks <= SUPERBLOCK_BITMAP_WORDS * 64);
+		superblock_pages[i] = num_pages;
+		superblock_blocks[i] = num_blocks;
+		block_size_reciprocals[i] = ((1ULL << 32) + BLOCK_SIZES[i] - 1) / BLOCK_SIZES[i];
+
+		magazine_capacity[i] = TCACHE_MAGAZINE_BYTES / BLOCK_SIZES[i];
+		if(magazine_capacity[i] > TCACHE_MAGAZINE_SIZE) { magazine_capacity[i] = TCACHE_MAGAZINE_SIZE; }
+		if(magazine_capacity[i] < 2) { magazine_capacity[i] = 2; }
 	}
 
-	// no page could be recycled - allocate a new one
-	if(page == NULL)
+	// a superblock of a few of these blocks strands its pages in its class until it is completely empty, while a run
+	// of one block goes back to the free runs, where it can coalesce, as soon as it is freed
+	first_page_run_class = NUM_SMALL_BLOCK_SIZES;
+	while(BLOCK_SIZES[first_page_run_class] <= MAX_SUPERBLOCK_BLOCK_SIZE)
 	{
-		pthread_mutex_lock(&global_heap_lock);
-		page = mem_sbrk(num_pages * mem_pagesize());
-		pthread_mutex_unlock(&global_heap_lock);
+		first_page_run_class++;
 	}
 
-	return page;
+	// a few cached blocks of every one of these classes would hold more memory than the lock they save is worth
+	for(unsigned int i = first_page_run_class; i < NUM_BLOCK_SIZES; i++)
+	{
+		page_run_pages[i] = align(BLOCK_SIZES[i], page_size) / page_size;
+		magazine_capacity[i] = 0;
+	}
 }
 
-void* alloc_small_block(size_t sz)
+#ifdef A3ALLOC_RSEQ
+// the C library registers this area with the kernel for every thread, the kernel keeps cpu_id current
+struct rseq* rseq_area()
 {
-	void* mem = NULL;
-	superblock* owner = NULL;
-	
-	processor_heap* heap = get_processor_heap();
-	pthread_mutex_lock(&heap->lock);
+	return (struct rseq*) ((char*) __builtin_thread_pointer() + __rseq_offset);
+}
 
-	unsigned int size_class = calculate_size_class(sz);
-	unsigned int size = BLOCK_SIZES[size_class];
+int rseq_registered()
+{
+	return (__rseq_size >= offsetof(struct rseq, cpu_id) + sizeof(rseq_area()->cpu_id)) &&
+		((int) rseq_area()->cpu_id >= 0);
+}
+#endif
 
-	// check if there are any blocks of the size class which are available for reuse
-	for(superblock* super_block = heap->subpage_allocations; super_block != NULL; super_block = super_block->next)
+// sets up the processor heaps of a family followed by their global heap
+void initialize_heaps(processor_heap* heaps, mm_heap* isolated)
+{
+	for(unsigned int i = 0; i <= num_processors; i++)
 	{
-		// check all the block sizes >= the required block size
-		for(unsigned int i = size_class; i < NUM_BLOCK_SIZES; i++)
+		char name[MM_LOCK_NAME_LENGTH];
+		if(i < num_processors)
 		{
-			if(super_block->free_block_list[i] != NULL)
-			{
-				free_block* block = get_free_entry(super_block, i); // take the block
-
-				if(i != size_class) // decompose the block if it is larger than the required size
-				{
-					debug_print("Reducing block at %p of size [%i] to [%i]\n", block, BLOCK_SIZES[i], BLOCK_SIZES[size_class]);
-					// decompose the large block into smaller blocks
-					for(unsigned int j = i; j > size_class; j--)
-					{
-						free_block* second = (free_block*) ((unsigned char*) block + (BLOCK_SIZES[j] / 2));
-						second->next = NULL;
-						second->prev = NULL;
-						insert_free_entry(size_class, second, super_block);
-
-						debug_print("\tCreate new entry at offset %li\n", (unsigned char*) second - (unsigned char*) block);
-					}
-				}
-
-				mem = block;
-				owner = super_block;
-				goto DONE;
-			}
+			snprintf(name, sizeof(name), "%sheap %u", (isolated != NULL) ? "isolated " : "", i);
 		}
-	}
-	
-	DONE:
-	if(mem == NULL)
-	{
-		// try to find a superblock with space to place the allocation in
-		superblock *block = NULL, *tail = NULL;
-		for(block = heap->subpage_allocations; block != NULL; block = block->next)
+		else
 		{
-			if(size + block->size_in_bytes <= superblock_size)
-			{
-				break;
-			}
-			tail = block;
+			snprintf(name, sizeof(name), "%sglobal heap", (isolated != NULL) ? "isolated " : "");
 		}
 
-		// allocate a new superblock and insert it into this heap
-		if(block == NULL)
-		{
-			block = alloc_pages(heap, PAGES_IN_SUPERBLOCK);
+		memset(&heaps[i], 0, sizeof(processor_heap));
+		mm_lock_init(&heaps[i].lock, name);
+		heaps[i].global = &heaps[num_processors];
+		heaps[i].isolated = isolated;
+	}
+}
 
-			if(block)
-			{
-				memset(block, 0, sizeof(superblock));
+// enabled by A3ALLOC_HEAP_PROFILE (a file to write the profile to at exit) or A3ALLOC_PROFILE_SAMPLE (the mean
+// number of bytes between samples)
+int initialize_profile()
+{
+	char* sample_bytes = getenv("A3ALLOC_PROFILE_SAMPLE");
+	profile_path = getenv("A3ALLOC_HEAP_PROFILE");
+	if((sample_bytes == NULL) && (profile_path == NULL))
+	{
+		return 0;
+	}
 
-				block->owner = heap;
-				block->size_in_bytes = BLOCK_SIZES[calculate_size_class(sizeof(superblock))]; // offset the size of the header
-			}
+	mm_lock_init(&profile_lock, "heap profile");
 
-			if(tail == NULL) {
-				heap->subpage_allocations = block;
-			} else {
-				tail->next = block;
-			}
-		}
+	profile_stacks = mmap(NULL, PROFILE_STACK_SLOTS * sizeof(profile_stack), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	profile_samples = mmap(NULL, PROFILE_SAMPLE_SLOTS * sizeof(profile_sample), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if((profile_stacks == MAP_FAILED) || (profile_samples == MAP_FAILED))
+	{
+		return -1;
+	}
 
-		owner = block;
-		mem = (unsigned char*) block + block->size_in_bytes;
-		block->size_in_bytes += size;
+	// the first backtrace loads the unwinder, which allocates, so it must not happen inside a sampled allocation
+	void* frame;
+	backtrace(&frame, 1);
+
+	if(profile_path != NULL)
+	{
+		atexit(dump_heap_profile);
 	}
 
-	// initialize the allocation header
-	if(mem != NULL)
+	profile_sample_bytes = (sample_bytes != NULL) ? strtoull(sample_bytes, NULL, 10) : 0;
+	if(profile_sample_bytes == 0)
 	{
-		subpage_allocation* header = (subpage_allocation*) mem;
-		header->owner = owner;
-		header->size_in_bytes = size;
+		profile_sample_bytes = PROFILE_DEFAULT_SAMPLE;
 	}
 
-	pthread_mutex_unlock(&heap->lock);
-	return mem;
+	return 0;
 }
 
-void* alloc_large_block(size_t sz)
+// enabled by A3ALLOC_TRACE_SLOW_NS, the number of nanoseconds from which a call counts as slow
+void initialize_trace()
 {
-	void* mem = NULL;
-	processor_heap* heap = get_processor_heap();
-
-	pthread_mutex_lock(&heap->lock);
+	char* slow_ns = getenv("A3ALLOC_TRACE_SLOW_NS");
+	if(slow_ns == NULL)
+	{
+		return;
+	}
 
-	unsigned long long page_size = mem_pagesize();
-	unsigned long long size_aligned_to_qwords = align(sz, 8);
-	unsigned long long size_aligned_to_pages = align(size_aligned_to_qwords, page_size);
-	unsigned long long num_pages = size_aligned_to_pages / page_size;
-	
-	large_allocation* allocation = alloc_pages(heap, num_pages);
-	allocation->size_in_bytes = size_aligned_to_pages;
-	allocation->owner = heap;
+	mm_lock_init(&trace_drain_lock, "slow call trace");
+
+	// the locks count TSC cycles on x86, measure how many of them make a nanosecond
+	struct timespec pause = {0, TRACE_CALIBRATION_NS};
+	struct timespec before, after;
+	clock_gettime(CLOCK_MONOTONIC, &before);
+	unsigned long long ticks = mm_lock_ticks();
+	nanosleep(&pause, NULL);
+	ticks = mm_lock_ticks() - ticks;
+	clock_gettime(CLOCK_MONOTONIC, &after);
+	trace_ticks_per_ns = ticks / (timespec_diff(&before, &after) * 1000000000.0);
+
+	trace_start_ticks = mm_lock_ticks();
+	trace_threshold_ticks = atof(slow_ns) * trace_ticks_per_ns;
+	if(trace_threshold_ticks == 0)
+	{
+		trace_threshold_ticks = 1;
+	}
 
-	mem = allocation;
-	
-	pthread_mutex_unlock(&heap->lock);
-	return mem;
+	atexit(mm_trace_print);
 }
 
-int free_small_block(subpage_allocation* ptr)
+int initialize()
 {
-	processor_heap* heap = ptr->owner->owner;
+	num_processors = getNumProcessors();
+	unsigned int page_size = mem_pagesize();
 
-	pthread_mutex_lock(&heap->lock);
+	assert(sizeof(superblock) <= SUPERBLOCK_HEADER_SIZE);
+	assert(NUM_BLOCK_SIZES == MM_STATS_CLASSES);
+	initialize_superblock_geometry(page_size);
 
-	superblock* owner = ptr->owner;
-	unsigned int size_class = calculate_size_class(ptr->size_in_bytes);
+	huge_page_pages = mem_hugepage_size() / page_size;
 
-	free_block* block = (free_block*) ptr;
-	block->next = NULL;
-	block->prev = NULL;
+	// the page map is reserved up front but only the entries of pages handed out by mem_sbrk ever get touched
+	page_shift = __builtin_ctz(page_size);
+	page_map_size = dseg_size >> page_shift;
+	page_map = mmap(NULL, page_map_size * sizeof(page_map_entry), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(page_map == MAP_FAILED)
+	{
+		return -1;
+	}
 
-	insert_free_entry(size_class, block, owner);
-	
-	pthread_mutex_unlock(&heap->lock);
-	return 0;
-}
+	// the global heap is stored right after the processor heaps
+	page_zero = mem_sbrk(align((num_processors + 1) * sizeof(processor_heap), page_size));
+	if(page_zero == NULL)
+	{
+		return -1;
+	}
 
-int free_large_block(large_allocation* ptr)
-{
-	processor_heap* heap = ptr->owner;
+	processor_heaps = (processor_heap*) page_zero;
+	global_heap = &processor_heaps[num_processors];
 
-	pthread_mutex_lock(&heap->lock);
+	initialize_heaps(processor_heaps, NULL);
 
-	unsigned int num_pages = ptr->size_in_bytes / mem_pagesize();
+	mm_lock_init(&isolated_heaps_lock, "isolated heaps");
+	mm_lock_init(&object_caches_lock, "object caches");
+	mm_lock_init(&usage_lock, "usage");
 
-	free_pages* pages = (free_pages*) ptr;
-	pages->num_pages = num_pages;
-	pages->next = heap->free_page_list;
-	heap->free_page_list = pages;
+#ifdef A3ALLOC_RSEQ
+	// cpu ids go up to the number of configured processors, which can be more than the online ones
+	if(rseq_registered())
+	{
+		num_cpu_caches = get_nprocs_conf();
+		cpu_caches = mem_sbrk(align(num_cpu_caches * sizeof(cpu_cache), page_size));
+	}
+#endif
 
-	pthread_mutex_unlock(&heap->lock);
-	return 0;
-}
+	pthread_key_create(&tcache_key, flush_thread_cache);
 
-void *mm_malloc(size_t sz)
-{
-	void* mem = NULL;
-	size_t size = sz + sizeof(subpage_allocation);
+	char* decay_ms = getenv("A3ALLOC_DECAY_MS");
+	if(decay_ms != NULL)
+	{
+		purge_decay = atof(decay_ms) / 1000.0;
+	}
 
-	if(size <= MAX_BLOCK_SIZE)
+#ifdef MADV_FREE
+	if(getenv("A3ALLOC_MADV_FREE") != NULL)
 	{
-		mem = alloc_small_block(size);
+		purge_advice = MADV_FREE;
 	}
-	else
+#endif
+
+	start_background_purge();
+
+	// no lock may be left held by a thread which does not exist in the child
+	pthread_atfork(lock_all_heaps, unlock_all_heaps, reset_after_fork);
+
+	if(getenv("A3ALLOC_FRAGMENTATION_REPORT") != NULL)
+	{
+		fragmentation_report = 1;
+		atexit(report_fragmentation);
+	}
+
+	if(getenv("A3ALLOC_STATS_REPORT") != NULL)
 	{
-		mem = alloc_large_block(size);
+		atexit(mm_stats_print);
 	}
 
-	return (unsigned char*) mem + sizeof(subpage_allocation);
+	initialize_trace();
+	return initialize_profile();
 }
 
-void mm_free(void *ptr)
+page_map_entry* page_map_lookup(void* ptr)
 {
-	unsigned long long size = *((unsigned long long*) ptr - 1);
+	return &page_map[((char*) ptr - dseg_lo) >> page_shift];
+}
 
-	if(size <= MAX_BLOCK_SIZE)
+// records the owner of a run of pages, num_pages is only set on the first page of a large allocation
+void page_map_set(void* ptr, unsigned long long num_pages, void* owner, unsigned long long large_pages)
+{
+	page_map_entry* entry = page_map_lookup(ptr);
+	for(unsigned long long i = 0; i < num_pages; i++)
 	{
-		free_small_block((subpage_allocation*) ((unsigned char*) ptr - sizeof(subpage_allocation)));
+		entry[i].owner = owner;
+		entry[i].num_pages = 0;
+		entry[i].is_free = 0;
+		entry[i].is_sampled = 0;
+		entry[i].is_isolated = 0;
+		entry[i].page_run_class = 0;
 	}
-	else
+
+	entry->num_pages = large_pages;
+}
+
+superblock* superblock_of(void* block)
+{
+	return page_map_lookup(block)->owner;
+}
+
+unsigned int current_cpu()
+{
+#ifdef A3ALLOC_RSEQ
+	if(cpu_caches != NULL)
 	{
-		free_large_block((large_allocation*) ((unsigned char*) ptr - sizeof(large_allocation)));
+		return rseq_area()->cpu_id;
 	}
+#endif
+
+	return sched_getcpu();
 }
 
-int mm_init(void)
+processor_heap* get_processor_heap()
+{
+	return &processor_heaps[current_cpu() % num_processors];
+}
+
+// maps a size (at most MAX_BLOCK_SIZE) to the smallest size class that fits it without searching the table
+unsigned int calculate_size_class(size_t sz)
 {
-	if(dseg_lo == NULL && dseg_hi == NULL)
+	if(sz <= BLOCK_SIZES[QUANTUM_SIZE_CLASSES - 1])
 	{
-		pthread_mutex_lock(&global_heap_lock);
+		return (sz <= 16) ? 0 : (sz - 1) / 16;
+	}
 
-		int result = mem_init();
-		if(result == 0)
+	// the doubling (base, 2 * base] containing sz, split into CLASSES_PER_DOUBLING evenly spaced classes
+	unsigned long long x = sz - 1;
+	unsigned int lg = 63 - __builtin_clzll(x);
+	unsigned int offset = (x - (1ULL << lg)) >> (lg - 2);
+
+	return QUANTUM_SIZE_CLASSES + (lg - 7) * CLASSES_PER_DOUBLING + offset;
+}
+
+// address of the block at a given index inside a superblock
+void* superblock_block(superblock* super_block, unsigned int index)
+{
+	return (unsigned char*) super_block + SUPERBLOCK_HEADER_SIZE + index * BLOCK_SIZES[super_block->size_class];
+}
+
+// index of a block inside its superblock, using a multiply since the offset is an exact multiple of the block size
+unsigned int superblock_block_index(superblock* super_block, void* block)
+{
+	unsigned long long offset = (unsigned char*) block - (unsigned char*) superblock_block(super_block, 0);
+	return (offset * block_size_reciprocals[super_block->size_class]) >> 32;
+}
+
+// claims up to max_blocks of the lowest free blocks in a superblock a bitmap word at a time, returns how many it took
+unsigned int take_free_blocks(superblock* super_block, void** blocks, size_t max_blocks)
+{
+	unsigned int count = 0;
+
+	for(unsigned int i = 0; (i < SUPERBLOCK_BITMAP_WORDS) && (count < max_blocks); i++)
+	{
+		unsigned long long word = super_block->free_bitmap[i];
+		while((word != 0) && (count < max_blocks))
 		{
-			initialize();
+			blocks[count++] = superblock_block(super_block, i * 64 + __builtin_ctzll(word));
+			word &= word - 1;
 		}
-		
-		pthread_mutex_unlock(&global_heap_lock);
-		return result;
+
+		super_block->free_bitmap[i] = word;
 	}
 
-	return 0;
+	super_block->num_free -= count;
+	return count;
+}
+
+void release_free_index(superblock* super_block, unsigned int index)
+{
+	assert((super_block->free_bitmap[index / 64] & (1ULL << (index % 64))) == 0);
+
+	super_block->free_bitmap[index / 64] |= 1ULL << (index % 64);
+	super_block->num_free++;
+}
+
+
+// bin holding free runs of num_pages pages, laid out like the size classes
+unsigned int page_bin(unsigned long long num_pages)
+{
+	if(num_pages <= EXACT_PAGE_BINS)
+	{
+		return num_pages - 1;
+	}
+
+	unsigned long long x = num_pages - 1;
+	unsigned int lg = 63 - __builtin_clzll(x);
+	unsigned int offset = (x - (1ULL << lg)) >> (lg - 2);
+	unsigned int bin = EXACT_PAGE_BINS + (lg - 4) * PAGE_BINS_PER_DOUBLING + offset;
+
+	return (bin < NUM_PAGE_BINS) ? bin : NUM_PAGE_BINS - 1;
+}
+
+void set_free_tags(free_pages* pages, void* owner, unsigned int is_free)
+{
+	page_map_entry* first = page_map_lookup(pages);
+	page_map_entry* last = first + pages->num_pages - 1;
+
+	first->owner = owner;
+	first->num_pages = pages->num_pages;
+	last->owner = owner;
+	last->num_pages = pages->num_pages;
+
+	// other heaps peek at the tags of neighbouring runs without our lock, publish the owner before the tag
+	__atomic_store_n(&first->is_free, is_free, __ATOMIC_RELEASE);
+	__atomic_store_n(&last->is_free, is_free, __ATOMIC_RELEASE);
+}
+
+double current_time()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1000000000.0;
+}
+
+// moves the traced call into another phase, charging the ticks since its last switch to the phase it was in and
+// to lock waits, returns the phase it was in
+__attribute__((noinline)) unsigned int switch_phase(unsigned int phase)
+{
+	unsigned long long now = mm_lock_ticks();
+	unsigned long long wait = mm_lock_thread_wait_ticks - traced_call.switched_wait;
+
+	traced_call.phase_ticks[traced_call.phase] += now - traced_call.switched_at - wait;
+	traced_call.phase_ticks[MM_TRACE_LOCK_WAIT] += wait;
+	traced_call.switched_at = now;
+	traced_call.switched_wait += wait;
+
+	unsigned int previous = traced_call.phase;
+	traced_call.phase = phase;
+	return previous;
+}
+
+// enters a phase of the call the thread is tracing, if it is tracing one, and returns the phase to go back to
+unsigned int begin_phase(unsigned int phase)
+{
+	return traced_call.active ? switch_phase(phase) : phase;
+}
+
+// goes back to the phase begin_phase returned, charging the list nodes walked meanwhile to the traced call
+void end_phase(unsigned int outer, unsigned int walked)
+{
+	if(traced_call.active)
+	{
+		switch_phase(outer);
+		traced_call.walk_length += walked;
+	}
+}
+
+// gives every page of a run but the one holding its header back to the OS, or only the huge pages it fully covers
+// so that the others are not split
+void purge_free_pages(free_pages* pages)
+{
+	unsigned long long page_size = mem_pagesize();
+	unsigned long long start = (unsigned long long) pages + page_size;
+	unsigned long long end = (unsigned long long) pages + pages->num_pages * page_size;
+
+	if(huge_page_pages != 0)
+	{
+		unsigned long long huge_page_size = huge_page_pages * page_size;
+		start = align(start, huge_page_size);
+		end &= ~(huge_page_size - 1);
+	}
+
+	if(start < end)
+	{
+		mem_release((void*) start, end - start, purge_advice);
+	}
+
+	pages->is_dirty = 0;
+}
+
+// adds a run of free pages to a heap's bins without coalescing it
+void link_free_pages(processor_heap* heap, void* ptr, unsigned long long num_pages, int is_dirty, double freed_at)
+{
+	unsigned int bin = page_bin(num_pages);
+	free_pages* pages = (free_pages*) ptr;
+	pages->num_pages = num_pages;
+	pages->is_dirty = is_dirty;
+	pages->freed_at = freed_at;
+	pages->prev = NULL;
+	pages->next = heap->free_page_bins[bin];
+
+	if(pages->next != NULL) { pages->next->prev = pages; }
+	heap->free_page_bins[bin] = pages;
+	heap->page_bin_mask |= 1ULL << bin;
+
+	set_free_tags(pages, heap, 1);
+}
+
+void unlink_free_pages(processor_heap* heap, free_pages* pages)
+{
+	unsigned int bin = page_bin(pages->num_pages);
+
+	if(pages->prev != NULL) { pages->prev->next = pages->next; }
+	else { heap->free_page_bins[bin] = pages->next; }
+
+	if(pages->next != NULL) { pages->next->prev = pages->prev; }
+
+	if(heap->free_page_bins[bin] == NULL)
+	{
+		heap->page_bin_mask &= ~(1ULL << bin);
+	}
+
+	set_free_tags(pages, heap, 0);
+}
+
+// the free run of this heap whose boundary tag is at the given page, if there is one
+free_pages* free_run_at(processor_heap* heap, unsigned long long page_index, int is_last_page)
+{
+	if(page_index >= page_map_size)
+	{
+		return NULL;
+	}
+
+	page_map_entry* entry = &page_map[page_index];
+	if(!__atomic_load_n(&entry->is_free, __ATOMIC_ACQUIRE) || (entry->owner != heap))
+	{
+		return NULL;
+	}
+
+	return (free_pages*) (dseg_lo + ((page_index + 1 - (is_last_page ? entry->num_pages : 1)) << page_shift));
+}
+
+// purges the runs of a heap which have been free for longer than the decay time, or all of them (the heap lock must be held)
+void purge_heap_pages(processor_heap* heap, double now, int purge_all)
+{
+	unsigned int outer = begin_phase(MM_TRACE_PURGE);
+	unsigned int walked = 0;
+
+	for(unsigned long long mask = heap->page_bin_mask; mask != 0; mask &= mask - 1)
+	{
+		for(free_pages* pages = heap->free_page_bins[__builtin_ctzll(mask)]; pages != NULL; pages = pages->next)
+		{
+			walked++;
+			if(pages->is_dirty && (purge_all || (now - pages->freed_at >= purge_decay)))
+			{
+				purge_free_pages(pages);
+			}
+		}
+	}
+
+	heap->next_purge = now + purge_decay / 2;
+	end_phase(outer, walked);
+}
+
+// returns a run of pages to a heap, merging it with the free runs of the same heap on either side
+void insert_free_pages(processor_heap* heap, void* ptr, unsigned long long num_pages)
+{
+	unsigned int outer = begin_phase(MM_TRACE_PAGE_FREE);
+	unsigned long long first_page = ((char*) ptr - dseg_lo) >> page_shift;
+	unsigned long long end_page = first_page + num_pages;
+
+	free_pages* before = (first_page > 0) ? free_run_at(heap, first_page - 1, 1) : NULL;
+	if(before != NULL)
+	{
+		unlink_free_pages(heap, before);
+		ptr = before;
+		num_pages += before->num_pages;
+	}
+
+	free_pages* after = free_run_at(heap, end_page, 0);
+	if(after != NULL)
+	{
+		unlink_free_pages(heap, after);
+		num_pages += after->num_pages;
+	}
+
+	// the merged run restarts its decay, the parts already purged just get purged again
+	double now = (purge_decay < 0) ? 0 : current_time();
+	link_free_pages(heap, ptr, num_pages, 1, now);
+	end_phase(outer, 0);
+
+	if(purge_decay == 0)
+	{
+		outer = begin_phase(MM_TRACE_PURGE);
+		purge_free_pages(ptr);
+		end_phase(outer, 0);
+	}
+	else if((purge_decay > 0) && (now >= heap->next_purge))
+	{
+		purge_heap_pages(heap, now, 0);
+	}
+}
+
+// takes the best fitting run out of a heap's bins, or returns NULL if no run is big enough
+free_pages* find_free_pages(processor_heap* heap, unsigned int num_pages)
+{
+	unsigned int outer = begin_phase(MM_TRACE_PAGE_SEARCH);
+	unsigned int walked = 0;
+	unsigned int bin = page_bin(num_pages);
+
+	// runs in the bin of the request can be shorter than it (except for the exact bins), pick the shortest that fits
+	free_pages* best = NULL;
+	for(free_pages* pages = heap->free_page_bins[bin]; pages != NULL; pages = pages->next)
+	{
+		walked++;
+		if((pages->num_pages >= num_pages) && ((best == NULL) || (pages->num_pages < best->num_pages)))
+		{
+			best = pages;
+			if(best->num_pages == num_pages)
+			{
+				break;
+			}
+		}
+	}
+
+	// any run in a later bin fits, take one from the first non-empty bin
+	if(best == NULL)
+	{
+		unsigned long long mask = (bin + 1 < NUM_PAGE_BINS) ? heap->page_bin_mask & (~0ULL << (bin + 1)) : 0;
+		if(mask != 0)
+		{
+			best = heap->free_page_bins[__builtin_ctzll(mask)];
+		}
+	}
+
+	end_phase(outer, walked);
+	return best;
+}
+
+// takes a run of pages out of a heap's free pages, or returns NULL if no run is big enough
+void* take_free_pages(processor_heap* heap, unsigned int num_pages)
+{
+	free_pages* pages = find_free_pages(heap, num_pages);
+	if(pages == NULL)
+	{
+		return NULL;
+	}
+
+	unsigned long long run_pages = pages->num_pages;
+	unlink_free_pages(heap, pages);
+
+	// carve the pages off the end of the run and put the rest back
+	if(run_pages > num_pages)
+	{
+		link_free_pages(heap, pages, run_pages - num_pages, pages->is_dirty, pages->freed_at);
+	}
+
+	return (unsigned char*) pages + (run_pages - num_pages) * mem_pagesize();
+}
+
+// makes room to record one more span of an isolated heap, the list lives outside of the heap so that it
+// survives until the heap is destroyed
+int reserve_span(processor_heap* heap)
+{
+	if(heap->num_spans < heap->max_spans)
+	{
+		return 1;
+	}
+
+	unsigned long long old_size = heap->max_spans * sizeof(heap_span);
+	unsigned long long new_size = (old_size > 0) ? 2 * old_size : mem_pagesize();
+	heap_span* spans = (old_size > 0) ? mremap(heap->spans, old_size, new_size, MREMAP_MAYMOVE) :
+		mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(spans == MAP_FAILED)
+	{
+		return 0;
+	}
+
+	heap->spans = spans;
+	heap->max_spans = new_size / sizeof(heap_span);
+	return 1;
+}
+
+// takes never used pages from the heap's reserve, refilling it from mem_sbrk in growing chunks (the heap lock must be held)
+void* take_reserve_pages(processor_heap* heap, unsigned long long num_pages)
+{
+	unsigned long long page_size = mem_pagesize();
+
+	if(heap->reserve_pages < num_pages)
+	{
+		if(heap->next_reserve_pages < MIN_RESERVE_PAGES)
+		{
+			heap->next_reserve_pages = MIN_RESERVE_PAGES;
+		}
+
+		unsigned long long chunk_pages = (num_pages > heap->next_reserve_pages) ? num_pages : heap->next_reserve_pages;
+		unsigned char* chunk = NULL;
+
+		if(heap->isolated != NULL)
+		{
+			if(!reserve_span(heap))
+			{
+				return NULL;
+			}
+
+			// isolated heaps recycle the pages destroyed ones gave back to the default global heap
+			mm_lock_acquire(&global_heap->lock, MM_LOCK_SBRK);
+			chunk = take_free_pages(global_heap, chunk_pages);
+			mm_lock_release(&global_heap->lock);
+		}
+
+		if(chunk == NULL)
+		{
+			unsigned int outer = begin_phase(MM_TRACE_SBRK);
+
+			// with huge pages the reserve is refilled a whole aligned huge page at a time, which packs the heap's
+			// superblocks into as few huge pages as possible
+			if(huge_page_pages != 0)
+			{
+				chunk_pages = align(chunk_pages, huge_page_pages);
+				chunk = mem_sbrk_aligned(chunk_pages * page_size, huge_page_pages * page_size);
+			}
+			else
+			{
+				chunk = mem_sbrk(chunk_pages * page_size);
+			}
+
+			end_phase(outer, 0);
+			traced_call.grew = 1;
+		}
+
+		if(chunk == NULL)
+		{
+			return NULL;
+		}
+
+		if(heap->isolated != NULL)
+		{
+			heap->spans[heap->num_spans].start = chunk;
+			heap->spans[heap->num_spans].num_pages = chunk_pages;
+			heap->num_spans++;
+		}
+
+		if(heap->next_reserve_pages < MAX_RESERVE_PAGES)
+		{
+			heap->next_reserve_pages *= 2;
+		}
+
+		// keep growing the reserve in place when no other heap moved the break in between, otherwise
+		// the leftover pages become an ordinary free run
+		if((heap->reserve_pages > 0) && (chunk == heap->reserve + heap->reserve_pages * page_size))
+		{
+			heap->reserve_pages += chunk_pages;
+		}
+		else
+		{
+			if(heap->reserve_pages > 0)
+			{
+				insert_free_pages(heap, heap->reserve, heap->reserve_pages);
+			}
+
+			heap->reserve = chunk;
+			heap->reserve_pages = chunk_pages;
+		}
+	}
+
+	void* page = heap->reserve;
+	heap->reserve += num_pages * page_size;
+	heap->reserve_pages -= num_pages;
+	return page;
+}
+
+// is_fresh (if given) is set when the pages come straight from mem_sbrk and are still zero
+void* alloc_pages(processor_heap* heap, unsigned int num_pages, int* is_fresh)
+{
+	// try to find a page available for reuse, first in this heap and then in the global heap
+	void* page = take_free_pages(heap, num_pages);
+
+	if((page == NULL) && (heap != heap->global))
+	{
+		mm_lock_acquire(&heap->global->lock, MM_LOCK_SBRK);
+		page = take_free_pages(heap->global, num_pages);
+		mm_lock_release(&heap->global->lock);
+	}
+
+	// no page could be recycled - carve new ones out of the heap's reserve
+	if(page == NULL)
+	{
+		page = take_reserve_pages(heap, num_pages);
+
+		if(is_fresh != NULL)
+		{
+			*is_fresh = 1;
+		}
+	}
+
+	return page;
+}
+
+// the heap a superblock currently belongs to (it only changes while the old owner's lock is held)
+processor_heap* superblock_owner(superblock* super_block)
+{
+	return __atomic_load_n(&super_block->owner, __ATOMIC_ACQUIRE);
+}
+
+unsigned int fullness_group(superblock* super_block)
+{
+	unsigned int used = super_block->num_blocks - super_block->num_free;
+	if(used == super_block->num_blocks)
+	{
+		return NUM_FULLNESS_GROUPS;
+	}
+
+	return used * NUM_FULLNESS_GROUPS / super_block->num_blocks;
+}
+
+void push_superblock(processor_heap* heap, superblock* super_block, unsigned int group)
+{
+	superblock** list = &heap->fullness_groups[super_block->size_class][group];
+
+	super_block->prev = NULL;
+	super_block->next = *list;
+
+	if(*list != NULL) { (*list)->prev = super_block; }
+	*list = super_block;
+
+	heap->group_masks[super_block->size_class] |= 1U << group;
+	heap->class_masks[group] |= 1ULL << super_block->size_class;
+}
+
+void remove_superblock(processor_heap* heap, superblock* super_block, unsigned int group)
+{
+	superblock** list = &heap->fullness_groups[super_block->size_class][group];
+
+	if(super_block->prev != NULL) { super_block->prev->next = super_block->next; }
+	else { *list = super_block->next; }
+
+	if(super_block->next != NULL) { super_block->next->prev = super_block->prev; }
+
+	if(*list == NULL)
+	{
+		heap->group_masks[super_block->size_class] &= ~(1U << group);
+		heap->class_masks[group] &= ~(1ULL << super_block->size_class);
+	}
+}
+
+// moves a superblock to the fullness group matching its current occupancy
+void regroup_superblock(processor_heap* heap, superblock* super_block, unsigned int old_group)
+{
+	unsigned int new_group = fullness_group(super_block);
+	if(new_group != old_group)
+	{
+		remove_superblock(heap, super_block, old_group);
+		push_superblock(heap, super_block, new_group);
+	}
+}
+
+// hands a superblock (and the accounting for its blocks) over to a heap (both heaps' locks must be held)
+void link_superblock(processor_heap* heap, superblock* super_block)
+{
+	unsigned long long size = BLOCK_SIZES[super_block->size_class];
+
+	push_superblock(heap, super_block, fullness_group(super_block));
+	heap->bytes_held += super_block->num_blocks * size;
+	heap->bytes_in_use += (super_block->num_blocks - super_block->num_free) * size;
+
+	__atomic_store_n(&super_block->owner, heap, __ATOMIC_RELEASE);
+}
+
+void unlink_superblock(processor_heap* heap, superblock* super_block)
+{
+	unsigned long long size = BLOCK_SIZES[super_block->size_class];
+
+	remove_superblock(heap, super_block, fullness_group(super_block));
+	heap->bytes_held -= super_block->num_blocks * size;
+	heap->bytes_in_use -= (super_block->num_blocks - super_block->num_free) * size;
+}
+
+// finds the fullest superblock of a size class that still has a free block
+superblock* find_superblock(processor_heap* heap, unsigned int size_class)
+{
+	unsigned int mask = heap->group_masks[size_class] & ((1U << NUM_FULLNESS_GROUPS) - 1); // skip the full group
+	if(mask == 0)
+	{
+		return NULL;
+	}
+
+	return heap->fullness_groups[size_class][31 - __builtin_clz(mask)];
+}
+
+// carves a new superblock for a size class out of the heap's pages and links it into the heap
+superblock* alloc_superblock(processor_heap* heap, unsigned int size_class)
+{
+	superblock* super_block = alloc_pages(heap, superblock_pages[size_class], NULL);
+	if(super_block == NULL)
+	{
+		return NULL;
+	}
+
+	page_map_set(super_block, superblock_pages[size_class], super_block, 0);
+	if(heap->isolated != NULL)
+	{
+		page_map_entry* entry = page_map_lookup(super_block);
+		for(unsigned int i = 0; i < superblock_pages[size_class]; i++)
+		{
+			entry[i].is_isolated = 1;
+		}
+	}
+
+	memset(super_block, 0, sizeof(superblock));
+	super_block->size_class = size_class;
+	super_block->num_pages = superblock_pages[size_class];
+	super_block->num_blocks = superblock_blocks[size_class];
+	super_block->num_free = super_block->num_blocks;
+
+	// mark every block as free
+	for(unsigned int i = 0; i < super_block->num_blocks; i += 64)
+	{
+		unsigned int bits = super_block->num_blocks - i;
+		super_block->free_bitmap[i / 64] = (bits >= 64) ? ~0ULL : (1ULL << bits) - 1;
+	}
+
+	link_superblock(heap, super_block);
+	return super_block;
+}
+
+// gives a superblock to the global heap, which recycles its pages if it is completely free (the heap lock must be held)
+void release_superblock(processor_heap* heap, superblock* super_block)
+{
+	processor_heap* global = heap->global;
+	unlink_superblock(heap, super_block);
+
+	mm_lock_acquire(&global->lock, MM_LOCK_SMALL_FREE);
+
+	if(super_block->num_free == super_block->num_blocks)
+	{
+		insert_free_pages(global, super_block, super_block->num_pages);
+	}
+	else
+	{
+		link_superblock(global, super_block);
+	}
+
+	mm_lock_release(&global->lock);
+}
+
+// Hoard's emptiness invariant: once a heap is more than 1/EMPTY_FRACTION empty and holds more than
+// HEAP_SLACK_SUPERBLOCKS superblocks worth of free blocks, its emptiest small superblock moves to the global heap
+void enforce_emptiness_threshold(processor_heap* heap)
+{
+	if(heap->bytes_in_use * EMPTY_FRACTION >= heap->bytes_held * (EMPTY_FRACTION - 1))
+	{
+		return;
+	}
+
+	// only groups below 1/2 fullness are considered, so the moved superblock is at least half empty, medium
+	// superblocks leave the heap as free runs once they are empty instead
+	for(unsigned int group = 0; group < NUM_FULLNESS_GROUPS / 2; group++)
+	{
+		unsigned long long small_classes = heap->class_masks[group] & ((1ULL << NUM_SMALL_BLOCK_SIZES) - 1);
+		if(small_classes != 0)
+		{
+			superblock* super_block = heap->fullness_groups[__builtin_ctzll(small_classes)][group];
+			unsigned long long slack = HEAP_SLACK_SUPERBLOCKS * super_block->num_pages * mem_pagesize();
+
+			if(heap->bytes_in_use + slack < heap->bytes_held)
+			{
+				release_superblock(heap, super_block);
+			}
+
+			return;
+		}
+	}
+}
+
+// pushes a chain of blocks onto another heap's remote free list without taking its lock
+void push_remote_frees(processor_heap* heap, remote_block* first, remote_block* last, unsigned int count)
+{
+	remote_block* head = __atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED);
+	do
+	{
+		last->next = head;
+	}
+	while(!__atomic_compare_exchange_n(&heap->remote_frees, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+	__atomic_fetch_add(&heap->num_remote_frees, count, __ATOMIC_RELAXED);
+}
+
+// returns blocks to the superblock they were all carved from, regrouping it only once
+// (the lock of the heap owning the superblock must be held)
+void heap_free_small_blocks(processor_heap* heap, superblock* super_block, void** blocks, unsigned int num_blocks)
+{
+	unsigned int old_group = fullness_group(super_block);
+
+	for(unsigned int i = 0; i < num_blocks; i++)
+	{
+		release_free_index(super_block, superblock_block_index(super_block, blocks[i]));
+	}
+
+	heap->bytes_in_use -= num_blocks * BLOCK_SIZES[super_block->size_class];
+	heap->class_counts[super_block->size_class].num_flushed += num_blocks;
+	regroup_superblock(heap, super_block, old_group);
+
+	// an empty medium superblock goes back to the heap's free runs right away, handed to the global heap its pages
+	// would sit between the runs of the processor heap without ever coalescing with them
+	if((heap != heap->global) && (super_block->size_class >= NUM_SMALL_BLOCK_SIZES) &&
+		(super_block->num_free == super_block->num_blocks))
+	{
+		unlink_superblock(heap, super_block);
+		insert_free_pages(heap, super_block, super_block->num_pages);
+	}
+	else if(heap != heap->global)
+	{
+		enforce_emptiness_threshold(heap);
+	}
+	else if(super_block->num_free == super_block->num_blocks)
+	{
+		// the global heap only keeps superblocks which still have live blocks
+		unlink_superblock(heap, super_block);
+		insert_free_pages(heap, super_block, super_block->num_pages);
+	}
+}
+
+// returns a block to the superblock it was carved from (the lock of the heap owning the superblock must be held)
+void heap_free_small_block(processor_heap* heap, void* ptr)
+{
+	heap_free_small_blocks(heap, superblock_of(ptr), &ptr, 1);
+}
+
+// returns a block of a page run class to the free runs of the heap that carved it
+void heap_free_page_run(void* ptr, page_map_entry* entry)
+{
+	processor_heap* heap = entry->owner;
+	mm_lock_acquire(&heap->lock, MM_LOCK_SMALL_FREE);
+
+	heap->class_counts[entry->page_run_class].num_flushed++;
+	insert_free_pages(heap, ptr, entry->num_pages);
+
+	mm_lock_release(&heap->lock);
+}
+
+// returns every block other threads pushed onto the heap to its superblock (the heap lock must be held)
+void drain_remote_frees(processor_heap* heap)
+{
+	if(__atomic_load_n(&heap->remote_frees, __ATOMIC_RELAXED) == NULL)
+	{
+		return;
+	}
+
+	unsigned int outer = begin_phase(MM_TRACE_REMOTE_DRAIN);
+	unsigned int walked = 0;
+
+	remote_block* block = __atomic_exchange_n(&heap->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	while(block != NULL)
+	{
+		remote_block* next = block->next;
+		walked++;
+		processor_heap* owner = superblock_owner(superblock_of(block));
+
+		if(owner == heap)
+		{
+			heap_free_small_block(heap, block);
+		}
+		else
+		{
+			// the superblock changed hands after the block was pushed, forward it to the new owner
+			push_remote_frees(owner, block, block, 0);
+		}
+
+		block = next;
+	}
+
+	end_phase(outer, walked);
+}
+
+// moves a superblock of the size class with free blocks from the global heap into this heap
+superblock* take_global_superblock(processor_heap* heap, unsigned int size_class)
+{
+	processor_heap* global = heap->global;
+	mm_lock_acquire(&global->lock, MM_LOCK_SMALL_ALLOC);
+
+	drain_remote_frees(global);
+
+	superblock* super_block = find_superblock(global, size_class);
+	if(super_block != NULL)
+	{
+		unlink_superblock(global, super_block);
+		link_superblock(heap, super_block);
+	}
+
+	mm_lock_release(&global->lock);
+	return super_block;
+}
+
+// takes up to num_blocks blocks of the given size class from the heap, draining one superblock at a time,
+// and returns how many it got (the heap lock must be held)
+// carves each block of a page run class as a run of its own (the heap lock must be held)
+size_t heap_alloc_page_runs(processor_heap* heap, unsigned int size_class, void** blocks, size_t num_blocks)
+{
+	unsigned int num_pages = page_run_pages[size_class];
+	size_t count = 0;
+
+	while(count < num_blocks)
+	{
+		void* block = alloc_pages(heap, num_pages, NULL);
+		if(block == NULL)
+		{
+			break;
+		}
+
+		page_map_set(block, 1, heap, num_pages);
+		page_map_entry* entry = page_map_lookup(block);
+		entry->page_run_class = size_class;
+		entry->is_isolated = (heap->isolated != NULL);
+
+		blocks[count++] = block;
+	}
+
+	heap->class_counts[size_class].num_refilled += count;
+	return count;
+}
+
+size_t heap_alloc_small_blocks(processor_heap* heap, unsigned int size_class, void** blocks, size_t num_blocks)
+{
+	size_t count = 0;
+
+	if(size_class >= first_page_run_class)
+	{
+		return heap_alloc_page_runs(heap, size_class, blocks, num_blocks);
+	}
+
+	while(count < num_blocks)
+	{
+		// reuse a partially full superblock, then one given up by another heap, before carving a new one
+		superblock* super_block = find_superblock(heap, size_class);
+
+		if(super_block == NULL)
+		{
+			super_block = take_global_superblock(heap, size_class);
+		}
+
+		if(super_block == NULL)
+		{
+			super_block = alloc_superblock(heap, size_class);
+			if(super_block == NULL)
+			{
+				break;
+			}
+		}
+
+		unsigned int old_group = fullness_group(super_block);
+		unsigned int taken = take_free_blocks(super_block, blocks + count, num_blocks - count);
+		heap->bytes_in_use += taken * BLOCK_SIZES[size_class];
+		regroup_superblock(heap, super_block, old_group);
+
+		count += taken;
+	}
+
+	heap->class_counts[size_class].num_refilled += count;
+	return count;
+}
+
+// takes a block of the given size class from the heap (the heap lock must be held)
+void* heap_alloc_small_block(processor_heap* heap, unsigned int size_class)
+{
+	void* block = NULL;
+	heap_alloc_small_blocks(heap, size_class, &block, 1);
+	return block;
+}
+
+void link_thread_cache(thread_cache* tc)
+{
+	mm_lock_acquire(&usage_lock, MM_LOCK_MAINTENANCE);
+	tc->prev = NULL;
+	tc->next = thread_caches;
+	if(thread_caches != NULL)
+	{
+		thread_caches->prev = tc;
+	}
+	thread_caches = tc;
+	mm_lock_release(&usage_lock);
+}
+
+// adds the cache's call counts to those of the exited threads and forgets it, called with usage_lock held
+void fold_thread_calls(thread_cache* tc)
+{
+	for(unsigned int i = 0; i <= NUM_BLOCK_SIZES; i++)
+	{
+		exited_thread_calls[i].num_allocs += tc->calls[i].num_allocs;
+		exited_thread_calls[i].num_frees += tc->calls[i].num_frees;
+		exited_thread_calls[i].num_bytes += tc->calls[i].num_bytes;
+	}
+	memset(tc->calls, 0, sizeof(tc->calls));
+
+	if(tc->prev != NULL)
+	{
+		tc->prev->next = tc->next;
+	}
+	else
+	{
+		thread_caches = tc->next;
+	}
+
+	if(tc->next != NULL)
+	{
+		tc->next->prev = tc->prev;
+	}
+}
+
+thread_cache* get_thread_cache()
+{
+	if(tcache.state == TCACHE_ACTIVE)
+	{
+		return &tcache;
+	}
+
+	if(tcache.state == TCACHE_UNINITIALIZED)
+	{
+		void** rounds = tcache.rounds;
+		for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+		{
+			tcache.magazines[i].rounds = rounds;
+			rounds += magazine_capacity[i];
+		}
+		assert(rounds <= tcache.rounds + TCACHE_ROUNDS);
+
+		// register the cache so that it gets flushed back to the heaps when the thread exits
+		pthread_setspecific(tcache_key, &tcache);
+		link_thread_cache(&tcache);
+		tcache.state = TCACHE_ACTIVE;
+		return &tcache;
+	}
+
+	return NULL;
+}
+
+// counts a large block handed out by a call on the default heaps, the internal ones (arena chunks, slabs, heap
+// headers) are not counted, the thread cache is set up so that the counts of a thread that never allocates a small
+// block are reachable too
+void* count_large_alloc(void* mem)
+{
+	get_thread_cache();
+
+	if(mem != NULL)
+	{
+		tcache.calls[LARGE_CALLS].num_allocs++;
+		tcache.calls[LARGE_CALLS].num_bytes += (unsigned long long) page_map_lookup(mem)->num_pages << page_shift;
+	}
+
+	return mem;
+}
+
+void count_large_free(page_map_entry* entry)
+{
+	get_thread_cache();
+	tcache.calls[LARGE_CALLS].num_frees++;
+	tcache.calls[LARGE_CALLS].num_bytes -= (unsigned long long) entry->num_pages << page_shift;
+}
+
+#ifdef A3ALLOC_RSEQ
+#define RSEQ_STRINGIFY(x) #x
+#define RSEQ_SIGNATURE(sig) RSEQ_STRINGIFY(sig)
+
+// descriptor of the critical section between labels 1 and 2, label 3 is its address and 4 the abort handler
+#define RSEQ_CRITICAL_SECTION \
+	".pushsection __rseq_cs, \"aw\"\n\t" \
+	".balign 32\n\t" \
+	"3:\n\t" \
+	".long 0, 0\n\t" \
+	".quad 1f, 2f - 1f, 4f\n\t" \
+	".popsection\n\t" \
+	"leaq 3b(%%rip), %%rax\n\t" \
+	"movq %%rax, %c[rseq_cs](%[rseq])\n\t"
+
+// the kernel checks the signature in front of the abort handler, which starts the sequence over
+#define RSEQ_ABORT_HANDLER \
+	".pushsection __rseq_failure, \"ax\"\n\t" \
+	".byte 0x0f, 0xb9, 0x3d\n\t" \
+	".long " RSEQ_SIGNATURE(RSEQ_SIG) "\n\t" \
+	"4:\n\t" \
+	"jmp %l[restart]\n\t" \
+	".popsection\n\t"
+
+// pops a block off the current processor's cache, or returns NULL when it is empty
+void* cpu_cache_pop(unsigned int size_class)
+{
+	void* block = NULL;
+
+restart:
+	asm goto(
+		RSEQ_CRITICAL_SECTION
+		"1:\n\t"
+		"movl %c[cpu_id](%[rseq]), %%eax\n\t"
+		"cmpl %[num_cpus], %%eax\n\t"
+		"jae %l[empty]\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[bin], %%rax\n\t"
+		"movl (%%rax), %%ecx\n\t"
+		"testl %%ecx, %%ecx\n\t"
+		"jz %l[empty]\n\t"
+		"subl $1, %%ecx\n\t"
+		"movq %c[rounds](%%rax, %%rcx, 8), %%rdx\n\t"
+		"movq %%rdx, (%[block])\n\t"
+		"movl %%ecx, (%%rax)\n\t" // commits the pop
+		"2:\n\t"
+		RSEQ_ABORT_HANDLER
+		:
+		: [rseq] "r" (rseq_area()), [rseq_cs] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu_id] "i" (offsetof(struct rseq, cpu_id)), [num_cpus] "r" (num_cpu_caches),
+		  [stride] "r" ((unsigned long long) sizeof(cpu_cache)), [bin] "r" (&cpu_caches[0].bins[size_class]),
+		  [rounds] "i" (offsetof(cpu_cache_bin, rounds)), [block] "r" (&block)
+		: "rax", "rcx", "rdx", "memory", "cc"
+		: restart, empty);
+
+	return block;
+
+empty:
+	return NULL;
+}
+
+// pushes a block onto the current processor's cache, or returns 0 when it is full
+int cpu_cache_push(unsigned int size_class, void* block)
+{
+restart:
+	asm goto(
+		RSEQ_CRITICAL_SECTION
+		"1:\n\t"
+		"movl %c[cpu_id](%[rseq]), %%eax\n\t"
+		"cmpl %[num_cpus], %%eax\n\t"
+		"jae %l[full]\n\t"
+		"imulq %[stride], %%rax\n\t"
+		"addq %[bin], %%rax\n\t"
+		"movl (%%rax), %%ecx\n\t"
+		"cmpl %[capacity], %%ecx\n\t"
+		"jae %l[full]\n\t"
+		"movq %[block], %c[rounds](%%rax, %%rcx, 8)\n\t"
+		"addl $1, %%ecx\n\t"
+		"movl %%ecx, (%%rax)\n\t" // commits the push
+		"2:\n\t"
+		RSEQ_ABORT_HANDLER
+		:
+		: [rseq] "r" (rseq_area()), [rseq_cs] "i" (offsetof(struct rseq, rseq_cs)),
+		  [cpu_id] "i" (offsetof(struct rseq, cpu_id)), [num_cpus] "r" (num_cpu_caches),
+		  [stride] "r" ((unsigned long long) sizeof(cpu_cache)), [bin] "r" (&cpu_caches[0].bins[size_class]),
+		  [rounds] "i" (offsetof(cpu_cache_bin, rounds)), [capacity] "i" (CPU_CACHE_SIZE), [block] "r" (block)
+		: "rax", "rcx", "memory", "cc"
+		: restart, full);
+
+	return 1;
+
+full:
+	return 0;
+}
+#endif
+
+// fills an empty magazine with a batch of blocks, from the processor's cache if it has any and otherwise
+// from the current processor heap under a single lock
+void refill_magazine(magazine* mag, unsigned int size_class)
+{
+	unsigned int batch_size = magazine_capacity[size_class] / 2;
+
+#ifdef A3ALLOC_RSEQ
+	if((cpu_caches != NULL) && (size_class < NUM_SMALL_BLOCK_SIZES))
+	{
+		void* block;
+		while((mag->count < batch_size) && ((block = cpu_cache_pop(size_class)) != NULL))
+		{
+			mag->rounds[mag->count++] = block;
+		}
+
+		if(mag->count > 0)
+		{
+			return;
+		}
+	}
+#endif
+
+	processor_heap* heap = get_processor_heap();
+	mm_lock_acquire(&heap->lock, MM_LOCK_SMALL_ALLOC);
+
+	drain_remote_frees(heap);
+	mag->count += heap_alloc_small_blocks(heap, size_class, mag->rounds + mag->count, batch_size - mag->count);
+
+	mm_lock_release(&heap->lock);
+}
+
+// returns blocks to their owning heaps, freeing each run of blocks from one of the local heap's superblocks
+// with a single regroup under a single lock, and pushing each run going to the same remote heap with a single CAS
+void free_small_blocks(void** blocks, size_t num_blocks)
+{
+	processor_heap* local_heap = get_processor_heap();
+	int locked = 0;
+
+	for(size_t i = 0; i < num_blocks; i++)
+	{
+		superblock* super_block = superblock_of(blocks[i]);
+		processor_heap* heap = superblock_owner(super_block);
+
+		if(heap == local_heap)
+		{
+			if(!locked)
+			{
+				mm_lock_acquire(&local_heap->lock, MM_LOCK_SMALL_FREE);
+				locked = 1;
+			}
+
+			// the superblock may have been given to the global heap before we got the lock
+			heap = superblock_owner(super_block);
+			if(heap == local_heap)
+			{
+				unsigned int count = 1;
+				while((i + count < num_blocks) && (superblock_of(blocks[i + count]) == super_block))
+				{
+					count++;
+				}
+
+				heap_free_small_blocks(local_heap, super_block, blocks + i, count);
+				i += count - 1;
+				continue;
+			}
+		}
+
+		// chain the run of blocks going to the same remote heap so it can be pushed with a single CAS
+		remote_block* first = (remote_block*) blocks[i];
+		remote_block* last = first;
+		unsigned int count = 1;
+
+		while((i + 1 < num_blocks) && (superblock_owner(superblock_of(blocks[i + 1])) == heap))
+		{
+			last->next = (remote_block*) blocks[++i];
+			last = last->next;
+			count++;
+		}
+
+		push_remote_frees(heap, first, last, count);
+	}
+
+	if(locked)
+	{
+		mm_lock_release(&local_heap->lock);
+	}
+}
+
+// returns the oldest num_blocks blocks of a magazine to the processor's cache while it has room, and the rest
+// to their owning heaps
+void flush_magazine(magazine* mag, unsigned int size_class, unsigned int num_blocks)
+{
+	unsigned int i = 0;
+
+#ifdef A3ALLOC_RSEQ
+	if((cpu_caches != NULL) && (size_class < NUM_SMALL_BLOCK_SIZES))
+	{
+		while((i < num_blocks) && cpu_cache_push(size_class, mag->rounds[i]))
+		{
+			i++;
+		}
+	}
+#endif
+
+	free_small_blocks(mag->rounds + i, num_blocks - i);
+
+	mag->count -= num_blocks;
+	memmove(mag->rounds, mag->rounds + num_blocks, mag->count * sizeof(void*));
+}
+
+// pthread key destructor: hands every cached block back to the heaps when a thread exits
+void flush_thread_cache(void* cache)
+{
+	thread_cache* tc = (thread_cache*) cache;
+
+	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+	{
+		flush_magazine(&tc->magazines[i], i, tc->magazines[i].count);
+	}
+
+	mm_lock_acquire(&usage_lock, MM_LOCK_MAINTENANCE);
+	fold_thread_calls(tc);
+	if(fragmentation_report)
+	{
+		for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+		{
+			exited_thread_usage[i].num_allocations += tc->usage[i].num_allocations;
+			exited_thread_usage[i].requested_bytes += tc->usage[i].requested_bytes;
+		}
+	}
+	mm_lock_release(&usage_lock);
+
+	if(thread_trace_ring != NULL)
+	{
+		__atomic_store_n(&thread_trace_ring->in_use, 0, __ATOMIC_RELEASE);
+		thread_trace_ring = NULL;
+	}
+
+	// any allocations made by later destructors bypass the cache
+	tc->state = TCACHE_DISABLED;
+}
+
+void* alloc_small_block(size_t sz)
+{
+	void* mem = NULL;
+	unsigned int size_class = calculate_size_class(sz);
+
+	tcache.calls[size_class].num_allocs++;
+
+	thread_cache* cache = get_thread_cache();
+	if(cache != NULL)
+	{
+		if(__builtin_expect(fragmentation_report, 0))
+		{
+			cache->usage[size_class].num_allocations++;
+			cache->usage[size_class].requested_bytes += sz;
+		}
+
+		magazine* mag = &cache->magazines[size_class];
+		if((mag->count == 0) && (magazine_capacity[size_class] > 0))
+		{
+			refill_magazine(mag, size_class);
+		}
+
+		if(mag->count > 0)
+		{
+			return mag->rounds[--mag->count];
+		}
+	}
+
+#ifdef A3ALLOC_RSEQ
+	if((cpu_caches != NULL) && (size_class < NUM_SMALL_BLOCK_SIZES) && ((mem = cpu_cache_pop(size_class)) != NULL))
+	{
+		return mem;
+	}
+#endif
+
+	processor_heap* heap = get_processor_heap();
+	mm_lock_acquire(&heap->lock, MM_LOCK_SMALL_ALLOC);
+	drain_remote_frees(heap);
+	mem = heap_alloc_small_block(heap, size_class);
+	mm_lock_release(&heap->lock);
+
+	if(mem == NULL)
+	{
+		tcache.calls[size_class].num_allocs--;
+	}
+
+	return mem;
+}
+
+// large allocation aligned beyond a page, carved out of a longer run whose unaligned ends go back to the heap
+// is_fresh (if given) is set as in alloc_pages
+void* alloc_aligned_large_block(processor_heap* heap, size_t sz, size_t alignment, int* is_fresh)
+{
+	if((sz > (size_t) dseg_size) || (alignment > (size_t) dseg_size))
+	{
+		return NULL;
+	}
+
+	unsigned long long page_size = mem_pagesize();
+	unsigned long long num_pages = align(sz, page_size) / page_size;
+	unsigned long long run_pages = num_pages + alignment / page_size - 1;
+
+	mm_lock_acquire(&heap->lock, MM_LOCK_LARGE_ALLOC);
+
+	unsigned char* run = alloc_pages(heap, run_pages, is_fresh);
+	unsigned char* mem = NULL;
+	if(run != NULL)
+	{
+		mem = (unsigned char*) align((unsigned long long) run, alignment);
+		page_map_set(mem, 1, heap, num_pages);
+
+		unsigned long long lead_pages = (mem - run) / page_size;
+		if(lead_pages > 0)
+		{
+			insert_free_pages(heap, run, lead_pages);
+		}
+
+		if(run_pages > lead_pages + num_pages)
+		{
+			insert_free_pages(heap, mem + num_pages * page_size, run_pages - lead_pages - num_pages);
+		}
+	}
+
+	mm_lock_release(&heap->lock);
+	return mem;
+}
+
+void* alloc_large_block(processor_heap* heap, size_t sz, int* is_fresh)
+{
+	void* mem = NULL;
+
+	// also keeps the page count below from overflowing
+	if(sz > (size_t) dseg_size)
+	{
+		return NULL;
+	}
+
+	// allocations spanning huge pages start on one, so that all of their huge pages are fully covered
+	unsigned long long huge_page_size = huge_page_pages * mem_pagesize();
+	if((huge_page_size != 0) && (sz >= huge_page_size))
+	{
+		return alloc_aligned_large_block(heap, sz, huge_page_size, is_fresh);
+	}
+
+	mm_lock_acquire(&heap->lock, MM_LOCK_LARGE_ALLOC);
+
+	unsigned long long page_size = mem_pagesize();
+	unsigned long long num_pages = align(sz, page_size) / page_size;
+
+	mem = alloc_pages(heap, num_pages, is_fresh);
+	if(mem != NULL)
+	{
+		page_map_set(mem, 1, heap, num_pages);
+	}
+
+	mm_lock_release(&heap->lock);
+	return mem;
+}
+
+// exponentially distributed with a mean of profile_sample_bytes, so that the sampled bytes form a Poisson process
+// and every allocated byte is equally likely to be sampled
+long long next_sample_interval()
+{
+	// xorshift64*, seeded from the address of the state, which differs between threads
+	unsigned long long x = sample_random_state;
+	if(x == 0)
+	{
+		x = ((unsigned long long) &sample_random_state * 0x9e3779b97f4a7c15ULL) | 1;
+	}
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	sample_random_state = x;
+
+	// -log2 of a uniform draw r / 2^64 in (0, 1), from the position of r's leading bit and a quadratic fit of
+	// log2 over its mantissa, which is precise enough for sampling and keeps libm out of the allocator
+	unsigned long long r = (x * 0x2545f4914f6cdd1dULL) | 1;
+	unsigned int lead = __builtin_clzll(r);
+	double mantissa = (double) (r << lead) / 9223372036854775808.0;
+	double neg_log2 = (lead + 1) - ((-0.34484843 * mantissa + 2.02466578) * mantissa - 1.67487759);
+
+	return (long long) (neg_log2 * 0.6931471805599453 * profile_sample_bytes) + 1;
+}
+
+unsigned long long profile_slot(unsigned long long key, unsigned long long num_slots)
+{
+	return ((key * 0x9e3779b97f4a7c15ULL) >> 32) & (num_slots - 1);
+}
+
+// finds or adds the entry of a call stack, NULL once the table is 3/4 full (the profile lock must be held)
+profile_stack* find_profile_stack(void** frames, unsigned int depth)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL ^ depth;
+	for(unsigned int i = 0; i < depth; i++)
+	{
+		hash = (hash ^ (unsigned long long) frames[i]) * 0x100000001b3ULL;
+	}
+	hash |= 1;
+
+	for(unsigned long long i = profile_slot(hash, PROFILE_STACK_SLOTS); ; i = (i + 1) & (PROFILE_STACK_SLOTS - 1))
+	{
+		profile_stack* stack = &profile_stacks[i];
+		if(stack->hash == 0)
+		{
+			if(num_profile_stacks * 4 >= PROFILE_STACK_SLOTS * 3)
+			{
+				return NULL;
+			}
+
+			num_profile_stacks++;
+			stack->hash = hash;
+			stack->depth = depth;
+			memcpy(stack->frames, frames, depth * sizeof(void*));
+			return stack;
+		}
+
+		if((stack->hash == hash) && (stack->depth == depth) && (memcmp(stack->frames, frames, depth * sizeof(void*)) == 0))
+		{
+			return stack;
+		}
+	}
+}
+
+// starts tracking a sampled block, returns 0 once the table is 3/4 full (the profile lock must be held)
+int insert_profile_sample(void* ptr, profile_stack* stack, size_t size)
+{
+	if(num_profile_samples * 4 >= PROFILE_SAMPLE_SLOTS * 3)
+	{
+		return 0;
+	}
+
+	unsigned long long i = profile_slot((unsigned long long) ptr, PROFILE_SAMPLE_SLOTS);
+	while(profile_samples[i].ptr != NULL)
+	{
+		i = (i + 1) & (PROFILE_SAMPLE_SLOTS - 1);
+	}
+
+	profile_samples[i].ptr = ptr;
+	profile_samples[i].stack = stack;
+	profile_samples[i].size = size;
+	num_profile_samples++;
+	return 1;
+}
+
+// stops tracking a sampled block, shifting back the samples probed past it so that lookups need no tombstones
+void forget_sample(void* ptr, page_map_entry* entry)
+{
+	unsigned long long mask = PROFILE_SAMPLE_SLOTS - 1;
+
+	mm_lock_acquire(&profile_lock, MM_LOCK_LARGE_FREE);
+
+	unsigned long long hole = profile_slot((unsigned long long) ptr, PROFILE_SAMPLE_SLOTS);
+	while(profile_samples[hole].ptr != ptr)
+	{
+		hole = (hole + 1) & mask;
+	}
+
+	profile_stack* stack = profile_samples[hole].stack;
+	stack->live_count--;
+	stack->live_bytes -= profile_samples[hole].size;
+
+	for(unsigned long long i = (hole + 1) & mask; profile_samples[i].ptr != NULL; i = (i + 1) & mask)
+	{
+		// a sample can move into the hole unless its home slot lies after the hole
+		unsigned long long home = profile_slot((unsigned long long) profile_samples[i].ptr, PROFILE_SAMPLE_SLOTS);
+		if(((i - home) & mask) >= ((i - hole) & mask))
+		{
+			profile_samples[hole] = profile_samples[i];
+			hole = i;
+		}
+	}
+
+	profile_samples[hole].ptr = NULL;
+	num_profile_samples--;
+
+	mm_lock_release(&profile_lock);
+	entry->is_sampled = 0;
+}
+
+// keeps tracking a sampled block resized in place, at its new requested size
+void resize_sample(void* ptr, size_t size)
+{
+	mm_lock_acquire(&profile_lock, MM_LOCK_LARGE_ALLOC);
+
+	unsigned long long i = profile_slot((unsigned long long) ptr, PROFILE_SAMPLE_SLOTS);
+	while(profile_samples[i].ptr != ptr)
+	{
+		i = (i + 1) & (PROFILE_SAMPLE_SLOTS - 1);
+	}
+
+	profile_stack* stack = profile_samples[i].stack;
+	stack->live_bytes -= profile_samples[i].size;
+	stack->live_bytes += size;
+	profile_samples[i].size = size;
+
+	mm_lock_release(&profile_lock);
+}
+
+// slow path of an allocation that took bytes_until_sample below 0, returns NULL when the allocation was not
+// sampled after all and has to take the usual path
+__attribute__((noinline)) void* sample_allocation(size_t sz, int* is_fresh)
+{
+	if(profile_sample_bytes == 0)
+	{
+		bytes_until_sample = LLONG_MAX;
+		return NULL;
+	}
+
+	bytes_until_sample = next_sample_interval();
+
+	// a sampled block gets pages of its own whatever its size, so that only the large block free path has to check
+	// whether a block is sampled
+	void* mem = count_large_alloc(alloc_large_block(get_processor_heap(), (sz > 0) ? sz : 1, is_fresh));
+	if(mem == NULL)
+	{
+		return NULL;
+	}
+
+	void* frames[PROFILE_SKIP_FRAMES + PROFILE_MAX_DEPTH];
+	int depth = backtrace(frames, PROFILE_SKIP_FRAMES + PROFILE_MAX_DEPTH) - PROFILE_SKIP_FRAMES;
+
+	mm_lock_acquire(&profile_lock, MM_LOCK_LARGE_ALLOC);
+
+	profile_stack* stack = find_profile_stack(frames + PROFILE_SKIP_FRAMES, (depth > 0) ? depth : 0);
+	if(stack != NULL)
+	{
+		stack->alloc_count++;
+		stack->alloc_bytes += sz;
+
+		if(insert_profile_sample(mem, stack, sz))
+		{
+			stack->live_count++;
+			stack->live_bytes += sz;
+			page_map_lookup(mem)->is_sampled = 1;
+		}
+	}
+
+	mm_lock_release(&profile_lock);
+	return mem;
+}
+
+// returns a block to the given heap when it owns the block's superblock, and otherwise pushes it onto the remote
+// free list of the heap that does
+void free_to_heap(processor_heap* heap, superblock* super_block, void* ptr)
+{
+	if(superblock_owner(super_block) == heap)
+	{
+		mm_lock_acquire(&heap->lock, MM_LOCK_SMALL_FREE);
+
+		// the superblock may have been given to the global heap before we got the lock
+		if(superblock_owner(super_block) == heap)
+		{
+			heap_free_small_block(heap, ptr);
+			mm_lock_release(&heap->lock);
+			return;
+		}
+
+		mm_lock_release(&heap->lock);
+	}
+
+	push_remote_frees(superblock_owner(super_block), (remote_block*) ptr, (remote_block*) ptr, 1);
+}
+
+int free_small_block(void* ptr, unsigned int size_class)
+{
+	tcache.calls[size_class].num_frees++;
+
+	thread_cache* cache = get_thread_cache();
+	if((cache != NULL) && (magazine_capacity[size_class] > 0))
+	{
+		magazine* mag = &cache->magazines[size_class];
+		if(mag->count == magazine_capacity[size_class])
+		{
+			flush_magazine(mag, size_class, magazine_capacity[size_class] / 2);
+		}
+
+		mag->rounds[mag->count++] = ptr;
+		return 0;
+	}
+
+#ifdef A3ALLOC_RSEQ
+	if((cpu_caches != NULL) && (size_class < NUM_SMALL_BLOCK_SIZES) && cpu_cache_push(size_class, ptr))
+	{
+		return 0;
+	}
+#endif
+
+	if(size_class >= first_page_run_class)
+	{
+		heap_free_page_run(ptr, page_map_lookup(ptr));
+		return 0;
+	}
+
+	free_to_heap(get_processor_heap(), superblock_of(ptr), ptr);
+	return 0;
+}
+
+// blocks of the page run classes skip the caches and go straight back to the heap that carved them
+int free_page_run(void* ptr, page_map_entry* entry)
+{
+	if(!entry->is_isolated)
+	{
+		get_thread_cache(); // so that the thread's counts are reachable
+		tcache.calls[entry->page_run_class].num_frees++;
+	}
+
+	heap_free_page_run(ptr, entry);
+	return 0;
+}
+
+// blocks of an isolated heap never enter the caches, which are shared with the default heaps
+int free_isolated_block(void* ptr, superblock* super_block)
+{
+	mm_heap* isolated = superblock_owner(super_block)->isolated;
+	free_to_heap(&isolated->heaps[current_cpu() % num_processors], super_block, ptr);
+	return 0;
+}
+
+int free_large_block(void* ptr, page_map_entry* entry)
+{
+	processor_heap* heap = entry->owner;
+
+	// before the pages go back, so that the block is no longer tracked by the time its address can be sampled again
+	if(entry->is_sampled)
+	{
+		forget_sample(ptr, entry);
+	}
+
+	mm_lock_acquire(&heap->lock, MM_LOCK_LARGE_FREE);
+
+	insert_free_pages(heap, ptr, entry->num_pages);
+
+	mm_lock_release(&heap->lock);
+	return 0;
+}
+
+// claims a ring for the calling thread, preferably one whose thread has exited, NULL once the thread is exiting
+trace_ring* claim_trace_ring()
+{
+	// the thread cache's destructor gives the ring back
+	if(get_thread_cache() == NULL)
+	{
+		return NULL;
+	}
+
+	for(trace_ring* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+	{
+		int expected = 0;
+		if(__atomic_compare_exchange_n(&ring->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			return ring;
+		}
+	}
+
+	trace_ring* ring = mmap(NULL, sizeof(trace_ring), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(ring == MAP_FAILED)
+	{
+		return NULL;
+	}
+
+	ring->in_use = 1;
+	ring->next = __atomic_load_n(&trace_rings, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&trace_rings, &ring->next, ring, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+	{
+	}
+
+	return ring;
+}
+
+unsigned int trace_ns(unsigned long long ticks)
+{
+	double ns = ticks / trace_ticks_per_ns;
+	return (ns < UINT_MAX) ? ns : UINT_MAX;
+}
+
+// writes the event of a slow call into the thread's ring, only slow calls pay for converting its ticks
+void record_slow_call(unsigned int op, size_t size, unsigned long long started, unsigned long long elapsed)
+{
+	if((thread_trace_ring == NULL) && ((thread_trace_ring = claim_trace_ring()) == NULL))
+	{
+		return;
+	}
+
+	trace_ring* ring = thread_trace_ring;
+	unsigned long long head = ring->head;
+	if(head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+	{
+		__atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	mm_trace_event_t* event = &ring->events[head & (TRACE_RING_SIZE - 1)];
+	event->timestamp_ns = (started - trace_start_ticks) / trace_ticks_per_ns;
+	event->thread = getTID();
+	event->op = op;
+	event->grew = traced_call.grew;
+	event->walk_length = (traced_call.walk_length < USHRT_MAX) ? traced_call.walk_length : USHRT_MAX;
+	event->size = size;
+	event->total_ns = trace_ns(elapsed);
+	for(unsigned int i = 0; i < MM_TRACE_PHASES; i++)
+	{
+		event->phase_ns[i] = trace_ns(traced_call.phase_ticks[i]);
+	}
+
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// from here on the thread's lock waits and phases are charged to the traced call
+unsigned long long begin_trace()
+{
+	memset(&traced_call, 0, sizeof(trace_call));
+	traced_call.active = 1;
+	traced_call.phase = MM_TRACE_PHASES;
+	traced_call.switched_wait = mm_lock_thread_wait_ticks;
+	traced_call.switched_at = mm_lock_ticks();
+	return traced_call.switched_at;
+}
+
+void end_trace(unsigned int op, size_t size, unsigned long long started)
+{
+	unsigned long long elapsed = mm_lock_ticks() - started;
+
+	if(elapsed >= trace_threshold_ticks)
+	{
+		switch_phase(MM_TRACE_PHASES);
+		record_slow_call(op, size, started, elapsed);
+	}
+
+	traced_call.active = 0;
+}
+
+void* alloc_block(size_t sz)
+{
+	void* mem = NULL;
+
+	// the only cost of heap profiling to allocations which are not sampled
+	if(__builtin_expect((bytes_until_sample -= sz) < 0, 0) && ((mem = sample_allocation(sz, NULL)) != NULL))
+	{
+		return mem;
+	}
+
+	if(sz <= MAX_BLOCK_SIZE)
+	{
+		mem = alloc_small_block(sz);
+	}
+	else
+	{
+		mem = count_large_alloc(alloc_large_block(get_processor_heap(), sz, NULL));
+	}
+
+	return mem;
+}
+
+// the traced calls are kept out of line, so that the untraced ones stay as lean as they were
+__attribute__((noinline)) void* traced_alloc_block(size_t sz)
+{
+	unsigned long long started = begin_trace();
+	void* mem = alloc_block(sz);
+	end_trace(MM_TRACE_MALLOC, sz, started);
+	return mem;
+}
+
+// tracing slow calls costs two timer reads per call, and a test of trace_threshold_ticks while it is off
+void *mm_malloc(size_t sz)
+{
+	if(__builtin_expect(trace_threshold_ticks != 0, 0))
+	{
+		return traced_alloc_block(sz);
+	}
+
+	return alloc_block(sz);
+}
+
+void free_block(void* ptr)
+{
+	// only the first page of a large allocation records a length
+	page_map_entry* entry = page_map_lookup(ptr);
+
+	if(entry->num_pages == 0)
+	{
+		superblock* super_block = entry->owner;
+		if(entry->is_isolated)
+		{
+			free_isolated_block(ptr, super_block);
+		}
+		else
+		{
+			free_small_block(ptr, super_block->size_class);
+		}
+	}
+	else if(entry->page_run_class != 0)
+	{
+		free_page_run(ptr, entry);
+	}
+	else
+	{
+		count_large_free(entry);
+		free_large_block(ptr, entry);
+	}
+}
+
+__attribute__((noinline)) void traced_free_block(void* ptr)
+{
+	size_t size = mm_usable_size(ptr);
+	unsigned long long started = begin_trace();
+	free_block(ptr);
+	end_trace(MM_TRACE_FREE, size, started);
+}
+
+void mm_free(void *ptr)
+{
+	if(ptr == NULL)
+	{
+		return;
+	}
+
+	if(__builtin_expect(trace_threshold_ticks != 0, 0))
+	{
+		traced_free_block(ptr);
+		return;
+	}
+
+	free_block(ptr);
+}
+
+void free_sized_block(void* ptr, size_t size)
+{
+#ifndef NDEBUG
+	// the size must map to the class the block was carved from, sampled and large blocks record no class
+	if(size <= MAX_BLOCK_SIZE)
+	{
+		page_map_entry* checked = page_map_lookup(ptr);
+		if(checked->num_pages == 0)
+		{
+			assert(((superblock*) checked->owner)->size_class == calculate_size_class(size));
+		}
+		else if(checked->page_run_class != 0)
+		{
+			assert(checked->page_run_class == calculate_size_class(size));
+		}
+	}
+#endif
+
+	// only a sampled block of a small size is large, and only an isolated heap's superblocks are tagged, so while
+	// neither exists this skips reading the block's page map entry as well
+	if((size <= MAX_BLOCK_SIZE) && (profile_sample_bytes == 0) && (__atomic_load_n(&isolated_heaps, __ATOMIC_RELAXED) == NULL))
+	{
+		free_small_block(ptr, calculate_size_class(size));
+		return;
+	}
+
+	page_map_entry* entry = page_map_lookup(ptr);
+
+	// sampled blocks are large whatever their size
+	if((size <= MAX_BLOCK_SIZE) && (entry->num_pages == 0))
+	{
+		if(entry->is_isolated)
+		{
+			free_isolated_block(ptr, entry->owner);
+		}
+		else
+		{
+			free_small_block(ptr, calculate_size_class(size));
+		}
+	}
+	else if(entry->page_run_class != 0)
+	{
+		free_page_run(ptr, entry);
+	}
+	else
+	{
+		count_large_free(entry);
+		free_large_block(ptr, entry);
+	}
+}
+
+__attribute__((noinline)) void traced_free_sized_block(void* ptr, size_t size)
+{
+	unsigned long long started = begin_trace();
+	free_sized_block(ptr, size);
+	end_trace(MM_TRACE_FREE, size, started);
+}
+
+// size must map to the same size class as the size the block was allocated with, this skips reading its superblock
+void mm_free_sized(void *ptr, size_t size)
+{
+	if(ptr == NULL)
+	{
+		return;
+	}
+
+	if(__builtin_expect(trace_threshold_ticks != 0, 0))
+	{
+		traced_free_sized_block(ptr, size);
+		return;
+	}
+
+	free_sized_block(ptr, size);
+}
+
+// allocates n blocks of the same size, small ones come out of the thread's magazine and then straight from the
+// processor heap's superblocks under a single lock, returns how many of out[] it filled
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t count = 0;
+
+	if(size > MAX_BLOCK_SIZE)
+	{
+		while((count < n) && ((out[count] = count_large_alloc(alloc_large_block(get_processor_heap(), size, NULL))) != NULL))
+		{
+			count++;
+		}
+
+		return count;
+	}
+
+	unsigned int size_class = calculate_size_class(size);
+
+	thread_cache* cache = get_thread_cache();
+	if(cache != NULL)
+	{
+		magazine* mag = &cache->magazines[size_class];
+		while((count < n) && (mag->count > 0))
+		{
+			out[count++] = mag->rounds[--mag->count];
+		}
+	}
+
+	if(count < n)
+	{
+		processor_heap* heap = get_processor_heap();
+		mm_lock_acquire(&heap->lock, MM_LOCK_SMALL_ALLOC);
+		drain_remote_frees(heap);
+		count += heap_alloc_small_blocks(heap, size_class, out + count, n - count);
+		mm_lock_release(&heap->lock);
+	}
+
+	tcache.calls[size_class].num_allocs += count;
+
+	if((cache != NULL) && fragmentation_report)
+	{
+		cache->usage[size_class].num_allocations += count;
+		cache->usage[size_class].requested_bytes += count * size;
+	}
+
+	return count;
+}
+
+// frees n blocks, each run of small blocks goes back to the heaps at once grouped by owning superblock,
+// so blocks that were allocated together are freed fastest when passed in the order they were allocated
+void mm_free_batch(void **ptrs, size_t n)
+{
+	size_t i = 0;
+
+	// so that the thread's counts are reachable
+	get_thread_cache();
+
+	while(i < n)
+	{
+		if(ptrs[i] == NULL)
+		{
+			i++;
+			continue;
+		}
+
+		page_map_entry* entry = page_map_lookup(ptrs[i]);
+		if(entry->page_run_class != 0)
+		{
+			free_page_run(ptrs[i], entry);
+			i++;
+			continue;
+		}
+
+		if(entry->num_pages != 0)
+		{
+			count_large_free(entry);
+			free_large_block(ptrs[i], entry);
+			i++;
+			continue;
+		}
+
+		size_t end = i;
+		while((end < n) && (ptrs[end] != NULL) && ((entry = page_map_lookup(ptrs[end]))->num_pages == 0))
+		{
+			if(!entry->is_isolated)
+			{
+				tcache.calls[((superblock*) entry->owner)->size_class].num_frees++;
+			}
+			end++;
+		}
+
+		free_small_blocks(ptrs + i, end - i);
+		i = end;
+	}
+}
+
+mm_heap *mm_heap_create(void)
+{
+	size_t size = sizeof(mm_heap) + (num_processors + 1) * sizeof(processor_heap);
+	mm_heap* heap = alloc_large_block(get_processor_heap(), size, NULL);
+	if(heap == NULL)
+	{
+		return NULL;
+	}
+
+	initialize_heaps(heap->heaps, heap);
+
+	mm_lock_acquire(&isolated_heaps_lock, MM_LOCK_MAINTENANCE);
+	heap->prev = NULL;
+	heap->next = isolated_heaps;
+	if(isolated_heaps != NULL) { isolated_heaps->prev = heap; }
+	__atomic_store_n(&isolated_heaps, heap, __ATOMIC_RELEASE);
+	mm_lock_release(&isolated_heaps_lock);
+
+	return heap;
+}
+
+// allocates straight from the heap's sub-heap for the current processor, bypassing the caches
+void *mm_heap_malloc(mm_heap *heap, size_t sz)
+{
+	processor_heap* sub_heap = &heap->heaps[current_cpu() % num_processors];
+
+	if(sz > MAX_BLOCK_SIZE)
+	{
+		return alloc_large_block(sub_heap, sz, NULL);
+	}
+
+	mm_lock_acquire(&sub_heap->lock, MM_LOCK_SMALL_ALLOC);
+	drain_remote_frees(sub_heap);
+	void* mem = heap_alloc_small_block(sub_heap, calculate_size_class(sz));
+	mm_lock_release(&sub_heap->lock);
+
+	return mem;
+}
+
+// gives every page the heap took from mem_sbrk to the default global heap at once, whatever its superblocks,
+// large allocations and free runs still hold
+void mm_heap_destroy(mm_heap *heap)
+{
+	if(heap == NULL)
+	{
+		return;
+	}
+
+	mm_lock_acquire(&isolated_heaps_lock, MM_LOCK_MAINTENANCE);
+	if(heap->prev != NULL) { heap->prev->next = heap->next; }
+	else { __atomic_store_n(&isolated_heaps, heap->next, __ATOMIC_RELEASE); }
+	if(heap->next != NULL) { heap->next->prev = heap->prev; }
+	mm_lock_release(&isolated_heaps_lock);
+
+	for(unsigned int i = 0; i <= num_processors; i++)
+	{
+		processor_heap* sub_heap = &heap->heaps[i];
+
+		mm_lock_acquire(&global_heap->lock, MM_LOCK_MAINTENANCE);
+		for(unsigned long long j = 0; j < sub_heap->num_spans; j++)
+		{
+			heap_span* span = &sub_heap->spans[j];
+
+			// wipe the span's boundary tags, they name a heap whose memory is about to be reused
+			memset(page_map_lookup(span->start), 0, span->num_pages * sizeof(page_map_entry));
+			insert_free_pages(global_heap, span->start, span->num_pages);
+		}
+		mm_lock_release(&global_heap->lock);
+
+		if(sub_heap->spans != NULL)
+		{
+			munmap(sub_heap->spans, sub_heap->max_spans * sizeof(heap_span));
+		}
+
+		mm_lock_destroy(&sub_heap->lock);
+	}
+
+	free_large_block(heap, page_map_lookup(heap));
+}
+
+// picks the smallest power of two number of pages that holds enough objects without wasting too much of the slab
+void initialize_cache_geometry(mm_cache* cache, unsigned long long alignment)
+{
+	unsigned long long page_size = mem_pagesize();
+
+	for(unsigned int num_pages = 1; num_pages <= CACHE_MAX_SLAB_PAGES; num_pages *= 2)
+	{
+		unsigned long long bytes = num_pages * page_size;
+		unsigned long long num_objects = (bytes - sizeof(cache_slab)) / (cache->object_size + sizeof(unsigned short));
+		unsigned long long header = align(sizeof(cache_slab) + num_objects * sizeof(unsigned short), alignment);
+
+		while((num_objects > 0) && (header + num_objects * cache->object_size > bytes))
+		{
+			num_objects--;
+			header = align(sizeof(cache_slab) + num_objects * sizeof(unsigned short), alignment);
+		}
+
+		cache->slab_size = bytes;
+		cache->slab_objects = num_objects;
+		cache->slab_header = header;
+
+		if((num_objects >= CACHE_MIN_SLAB_OBJECTS) && ((bytes - header - num_objects * cache->object_size) * 8 <= bytes))
+		{
+			break;
+		}
+	}
+}
+
+mm_cache *mm_cache_create(const char *name, size_t size, size_t alignment, void (*ctor)(void *), void (*dtor)(void *))
+{
+	if(alignment == 0)
+	{
+		alignment = sizeof(void*);
+	}
+
+	if(((alignment & (alignment - 1)) != 0) || (size == 0) || (size > CACHE_MAX_SLAB_PAGES * mem_pagesize()))
+	{
+		return NULL;
+	}
+
+	size_t cache_size = sizeof(mm_cache) + num_processors * sizeof(cache_magazine);
+	mm_cache* cache = alloc_large_block(get_processor_heap(), cache_size, NULL);
+	if(cache == NULL)
+	{
+		return NULL;
+	}
+
+	memset(cache, 0, cache_size);
+	strncpy(cache->name, (name != NULL) ? name : "", CACHE_NAME_LENGTH - 1);
+	cache->object_size = align(size, alignment);
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+	initialize_cache_geometry(cache, alignment);
+
+	if(cache->slab_objects == 0)
+	{
+		free_large_block(cache, page_map_lookup(cache));
+		return NULL;
+	}
+
+	mm_lock_init(&cache->lock, cache->name);
+	for(unsigned int i = 0; i < num_processors; i++)
+	{
+		char name[MM_LOCK_NAME_LENGTH];
+		snprintf(name, sizeof(name), "%.16s cpu %u", cache->name, i);
+		mm_lock_init(&cache->magazines[i].lock, name);
+	}
+
+	mm_lock_acquire(&object_caches_lock, MM_LOCK_MAINTENANCE);
+	cache->prev = NULL;
+	cache->next = object_caches;
+	if(object_caches != NULL) { object_caches->prev = cache; }
+	object_caches = cache;
+	mm_lock_release(&object_caches_lock);
+
+	return cache;
+}
+
+void* slab_object(mm_cache* cache, cache_slab* slab, unsigned int index)
+{
+	return (unsigned char*) slab + cache->slab_header + index * cache->object_size;
+}
+
+cache_slab* slab_of(mm_cache* cache, void* object)
+{
+	return (cache_slab*) ((unsigned long long) object & ~(cache->slab_size - 1));
+}
+
+void push_slab(mm_cache* cache, cache_slab* slab, unsigned int list)
+{
+	slab->list = list;
+	slab->prev = NULL;
+	slab->next = cache->slabs[list];
+
+	if(slab->next != NULL) { slab->next->prev = slab; }
+	cache->slabs[list] = slab;
+	cache->num_slabs[list]++;
+}
+
+void remove_slab(mm_cache* cache, cache_slab* slab)
+{
+	if(slab->prev != NULL) { slab->prev->next = slab->next; }
+	else { cache->slabs[slab->list] = slab->next; }
+
+	if(slab->next != NULL) { slab->next->prev = slab->prev; }
+	cache->num_slabs[slab->list]--;
+}
+
+// carves a new slab out of the current processor heap and constructs all of its objects (the cache lock must be held)
+cache_slab* create_slab(mm_cache* cache)
+{
+	cache_slab* slab = alloc_aligned_large_block(get_processor_heap(), cache->slab_size, cache->slab_size, NULL);
+	if(slab == NULL)
+	{
+		return NULL;
+	}
+
+	slab->num_free = cache->slab_objects;
+	for(unsigned int i = 0; i < cache->slab_objects; i++)
+	{
+		// popped from the end, so the objects are handed out in address order
+		slab->free_stack[i] = cache->slab_objects - 1 - i;
+
+		if(cache->ctor != NULL)
+		{
+			cache->ctor(slab_object(cache, slab, i));
+		}
+	}
+
+	push_slab(cache, slab, SLAB_EMPTY);
+	cache->slabs_created++;
+	return slab;
+}
+
+// destructs the free objects of a slab and gives its pages back to their heap (the cache lock must be held)
+void destroy_slab(mm_cache* cache, cache_slab* slab)
+{
+	remove_slab(cache, slab);
+
+	if(cache->dtor != NULL)
+	{
+		for(unsigned int i = 0; i < slab->num_free; i++)
+		{
+			cache->dtor(slab_object(cache, slab, slab->free_stack[i]));
+		}
+	}
+
+	free_large_block(slab, page_map_lookup(slab));
+	cache->slabs_destroyed++;
+}
+
+// fills an empty magazine with a batch of objects from the fullest slabs (the magazine lock must be held)
+void refill_cache_magazine(mm_cache* cache, cache_magazine* mag)
+{
+	mm_lock_acquire(&cache->lock, MM_LOCK_SMALL_ALLOC);
+
+	while(mag->count < CACHE_BATCH_SIZE)
+	{
+		cache_slab* slab = (cache->slabs[SLAB_PARTIAL] != NULL) ? cache->slabs[SLAB_PARTIAL] : cache->slabs[SLAB_EMPTY];
+		if(slab == NULL)
+		{
+			slab = create_slab(cache);
+			if(slab == NULL)
+			{
+				break;
+			}
+		}
+
+		while((mag->count < CACHE_BATCH_SIZE) && (slab->num_free > 0))
+		{
+			mag->rounds[mag->count++] = slab_object(cache, slab, slab->free_stack[--slab->num_free]);
+		}
+
+		remove_slab(cache, slab);
+		push_slab(cache, slab, (slab->num_free == 0) ? SLAB_FULL : SLAB_PARTIAL);
+	}
+
+	mm_lock_release(&cache->lock);
+}
+
+// returns the oldest num_objects objects of a magazine to their slabs, slabs left completely free stay constructed
+// until the cache is reaped (the magazine lock must be held)
+void flush_cache_magazine(mm_cache* cache, cache_magazine* mag, unsigned int num_objects)
+{
+	mm_lock_acquire(&cache->lock, MM_LOCK_SMALL_FREE);
+
+	for(unsigned int i = 0; i < num_objects; i++)
+	{
+		cache_slab* slab = slab_of(cache, mag->rounds[i]);
+		unsigned long long offset = (unsigned char*) mag->rounds[i] - (unsigned char*) slab_object(cache, slab, 0);
+		slab->free_stack[slab->num_free++] = offset / cache->object_size;
+
+		if(slab->num_free == cache->slab_objects)
+		{
+			remove_slab(cache, slab);
+			push_slab(cache, slab, SLAB_EMPTY);
+		}
+		else if(slab->list == SLAB_FULL)
+		{
+			remove_slab(cache, slab);
+			push_slab(cache, slab, SLAB_PARTIAL);
+		}
+	}
+
+	mm_lock_release(&cache->lock);
+
+	mag->count -= num_objects;
+	memmove(mag->rounds, mag->rounds + num_objects, mag->count * sizeof(void*));
+}
+
+void *mm_cache_alloc(mm_cache *cache)
+{
+	cache_magazine* mag = &cache->magazines[current_cpu() % num_processors];
+	void* object = NULL;
+
+	mm_lock_acquire(&mag->lock, MM_LOCK_SMALL_ALLOC);
+
+	if(mag->count == 0)
+	{
+		refill_cache_magazine(cache, mag);
+	}
+
+	if(mag->count > 0)
+	{
+		object = mag->rounds[--mag->count];
+		mag->num_allocs++;
+	}
+
+	mm_lock_release(&mag->lock);
+	return object;
+}
+
+// the object goes back constructed, so it must be in the state its constructor left it in
+void mm_cache_free(mm_cache *cache, void *object)
+{
+	if(object == NULL)
+	{
+		return;
+	}
+
+	cache_magazine* mag = &cache->magazines[current_cpu() % num_processors];
+
+	mm_lock_acquire(&mag->lock, MM_LOCK_SMALL_FREE);
+
+	if(mag->count == CACHE_MAGAZINE_SIZE)
+	{
+		flush_cache_magazine(cache, mag, CACHE_BATCH_SIZE);
+	}
+
+	mag->rounds[mag->count++] = object;
+	mag->num_frees++;
+
+	mm_lock_release(&mag->lock);
+}
+
+// returns every object cached by the processors to its slab and destroys the slabs left completely free
+void reap_cache(mm_cache* cache)
+{
+	for(unsigned int i = 0; i < num_processors; i++)
+	{
+		mm_lock_acquire(&cache->magazines[i].lock, MM_LOCK_MAINTENANCE);
+		flush_cache_magazine(cache, &cache->magazines[i], cache->magazines[i].count);
+		mm_lock_release(&cache->magazines[i].lock);
+	}
+
+	mm_lock_acquire(&cache->lock, MM_LOCK_MAINTENANCE);
+	while(cache->slabs[SLAB_EMPTY] != NULL)
+	{
+		destroy_slab(cache, cache->slabs[SLAB_EMPTY]);
+	}
+	mm_lock_release(&cache->lock);
+}
+
+void mm_cache_stats(mm_cache *cache, mm_cache_stats_t *stats)
+{
+	memset(stats, 0, sizeof(mm_cache_stats_t));
+	stats->name = cache->name;
+	stats->object_size = cache->object_size;
+	stats->slab_size = cache->slab_size;
+	stats->slab_objects = cache->slab_objects;
+
+	for(unsigned int i = 0; i < num_processors; i++)
+	{
+		cache_magazine* mag = &cache->magazines[i];
+
+		mm_lock_acquire(&mag->lock, MM_LOCK_MAINTENANCE);
+		stats->allocs += mag->num_allocs;
+		stats->frees += mag->num_frees;
+		stats->cached_objects += mag->count;
+		mm_lock_release(&mag->lock);
+	}
+
+	mm_lock_acquire(&cache->lock, MM_LOCK_MAINTENANCE);
+	for(unsigned int i = 0; i < NUM_SLAB_LISTS; i++)
+	{
+		stats->slabs += cache->num_slabs[i];
+	}
+	stats->slabs_created = cache->slabs_created;
+	stats->slabs_destroyed = cache->slabs_destroyed;
+	mm_lock_release(&cache->lock);
+}
+
+// destructs the cached and free objects and releases every slab, objects still allocated are lost with them
+void mm_cache_destroy(mm_cache *cache)
+{
+	if(cache == NULL)
+	{
+		return;
+	}
+
+	mm_lock_acquire(&object_caches_lock, MM_LOCK_MAINTENANCE);
+	if(cache->prev != NULL) { cache->prev->next = cache->next; }
+	else { object_caches = cache->next; }
+	if(cache->next != NULL) { cache->next->prev = cache->prev; }
+	mm_lock_release(&object_caches_lock);
+
+	reap_cache(cache);
+
+	for(unsigned int list = 0; list < NUM_SLAB_LISTS; list++)
+	{
+		while(cache->slabs[list] != NULL)
+		{
+			destroy_slab(cache, cache->slabs[list]);
+		}
+	}
+
+	for(unsigned int i = 0; i < num_processors; i++)
+	{
+		mm_lock_destroy(&cache->magazines[i].lock);
+	}
+	mm_lock_destroy(&cache->lock);
+
+	free_large_block(cache, page_map_lookup(cache));
+}
+
+size_t mm_usable_size(void *ptr)
+{
+	if(ptr == NULL)
+	{
+		return 0;
+	}
+
+	page_map_entry* entry = page_map_lookup(ptr);
+
+	if(entry->num_pages == 0)
+	{
+		return BLOCK_SIZES[((superblock*) entry->owner)->size_class];
+	}
+
+	return entry->num_pages * mem_pagesize();
+}
+
+mm_arena *mm_arena_create(void)
+{
+	mm_arena* arena = alloc_small_block(sizeof(mm_arena));
+	if(arena != NULL)
+	{
+		memset(arena, 0, sizeof(mm_arena));
+		arena->chunk_pages = ARENA_MIN_CHUNK_PAGES;
+	}
+
+	return arena;
+}
+
+// starts a new chunk when the current one cannot fit an object, or gives a large object a chunk of its own
+void* arena_alloc_chunk(mm_arena* arena, size_t size)
+{
+	unsigned long long page_size = mem_pagesize();
+	unsigned long long header = align(sizeof(arena_chunk), ARENA_ALIGNMENT);
+
+	if(header + size > ARENA_MAX_CHUNK_PAGES * page_size / 4)
+	{
+		arena_chunk* chunk = alloc_large_block(get_processor_heap(), header + size, NULL);
+		if(chunk == NULL)
+		{
+			return NULL;
+		}
+
+		chunk->next = arena->large_chunks;
+		arena->large_chunks = chunk;
+		return (unsigned char*) chunk + header;
+	}
+
+	while(arena->chunk_pages * page_size < header + size)
+	{
+		arena->chunk_pages *= 2;
+	}
+
+	arena_chunk* chunk = alloc_large_block(get_processor_heap(), arena->chunk_pages * page_size, NULL);
+	if(chunk == NULL)
+	{
+		return NULL;
+	}
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	arena->cursor = (unsigned char*) chunk + header + size;
+	arena->limit = (unsigned char*) chunk + arena->chunk_pages * page_size;
+
+	if(arena->chunk_pages < ARENA_MAX_CHUNK_PAGES)
+	{
+		arena->chunk_pages *= 2;
+	}
+
+	return (unsigned char*) chunk + header;
+}
+
+void *mm_arena_alloc(mm_arena *arena, size_t size)
+{
+	// also keeps the alignment below from overflowing
+	if(size > (size_t) dseg_size)
+	{
+		return NULL;
+	}
+
+	size = (size == 0) ? ARENA_ALIGNMENT : align(size, ARENA_ALIGNMENT);
+
+	if(size <= (size_t) (arena->limit - arena->cursor))
+	{
+		void* mem = arena->cursor;
+		arena->cursor += size;
+		return mem;
+	}
+
+	return arena_alloc_chunk(arena, size);
+}
+
+// gives a list of arena chunks back to the heaps that own their pages
+void free_arena_chunks(arena_chunk* chunk)
+{
+	while(chunk != NULL)
+	{
+		arena_chunk* next = chunk->next;
+		free_large_block(chunk, page_map_lookup(chunk));
+		chunk = next;
+	}
+}
+
+// frees every object of the arena, keeping its current chunk for the next ones
+void mm_arena_reset(mm_arena *arena)
+{
+	free_arena_chunks(arena->large_chunks);
+	arena->large_chunks = NULL;
+
+	if(arena->chunks != NULL)
+	{
+		free_arena_chunks(arena->chunks->next);
+		arena->chunks->next = NULL;
+
+		arena->cursor = (unsigned char*) arena->chunks + align(sizeof(arena_chunk), ARENA_ALIGNMENT);
+		arena->limit = (unsigned char*) arena->chunks + page_map_lookup(arena->chunks)->num_pages * mem_pagesize();
+	}
+}
+
+void mm_arena_destroy(mm_arena *arena)
+{
+	if(arena == NULL)
+	{
+		return;
+	}
+
+	free_arena_chunks(arena->large_chunks);
+	free_arena_chunks(arena->chunks);
+	free_small_block(arena, calculate_size_class(sizeof(mm_arena)));
+}
+
+void *mm_calloc(size_t nmemb, size_t size)
+{
+	size_t total;
+	if(__builtin_mul_overflow(nmemb, size, &total))
+	{
+		return NULL;
+	}
+
+	// pages fresh from mem_sbrk have never been written to
+	int is_fresh = 0;
+	void* mem = NULL;
+
+	if(__builtin_expect((bytes_until_sample -= total) < 0, 0) && ((mem = sample_allocation(total, &is_fresh)) != NULL))
+	{
+		if(!is_fresh)
+		{
+			memset(mem, 0, total);
+		}
+
+		return mem;
+	}
+
+	if(total <= MAX_BLOCK_SIZE)
+	{
+		mem = alloc_small_block(total);
+		if(mem != NULL)
+		{
+			memset(mem, 0, total);
+		}
+
+		return mem;
+	}
+
+	mem = count_large_alloc(alloc_large_block(get_processor_heap(), total, &is_fresh));
+	if((mem != NULL) && !is_fresh)
+	{
+		memset(mem, 0, total);
+	}
+
+	return mem;
+}
+
+// resizes a large allocation without moving it, by giving up its tail or taking over the free run right after it
+int resize_large_block(void* ptr, page_map_entry* entry, size_t sz)
+{
+	processor_heap* heap = entry->owner;
+	unsigned long long page_size = mem_pagesize();
+	unsigned long long num_pages = align(sz, page_size) / page_size;
+	int resized = 0;
+
+	mm_lock_acquire(&heap->lock, MM_LOCK_LARGE_ALLOC);
+
+	unsigned long long old_pages = entry->num_pages;
+	if(num_pages <= old_pages)
+	{
+		if(num_pages < old_pages)
+		{
+			entry->num_pages = num_pages;
+			insert_free_pages(heap, (unsigned char*) ptr + num_pages * page_size, old_pages - num_pages);
+		}
+
+		resized = 1;
+	}
+	else
+	{
+		unsigned long long end_page = (((char*) ptr - dseg_lo) >> page_shift) + old_pages;
+		free_pages* after = free_run_at(heap, end_page, 0);
+
+		if((after != NULL) && (old_pages + after->num_pages >= num_pages))
+		{
+			unsigned long long extra_pages = num_pages - old_pages;
+			unsigned long long run_pages = after->num_pages;
+			unlink_free_pages(heap, after);
+
+			if(run_pages > extra_pages)
+			{
+				link_free_pages(heap, (unsigned char*) after + extra_pages * page_size, run_pages - extra_pages,
+					after->is_dirty, after->freed_at);
+			}
+
+			entry->num_pages = num_pages;
+			resized = 1;
+		}
+	}
+
+	mm_lock_release(&heap->lock);
+
+	if(resized)
+	{
+		tcache.calls[LARGE_CALLS].num_bytes += (num_pages - old_pages) << page_shift;
+	}
+
+	if(resized && entry->is_sampled)
+	{
+		resize_sample(ptr, sz);
+	}
+
+	return resized;
+}
+
+void *mm_realloc(void *ptr, size_t size)
+{
+	if(ptr == NULL)
+	{
+		return mm_malloc(size);
+	}
+
+	if(size == 0)
+	{
+		mm_free(ptr);
+		return NULL;
+	}
+
+	if(size > (size_t) dseg_size)
+	{
+		return NULL;
+	}
+
+	size_t usable = mm_usable_size(ptr);
+	page_map_entry* entry = page_map_lookup(ptr);
+
+	// small blocks stay put while the new size maps to the same size class (so that mm_free_sized still works)
+	if((entry->num_pages == 0) || (entry->page_run_class != 0))
+	{
+		unsigned int size_class = (entry->num_pages == 0) ? ((superblock*) entry->owner)->size_class : entry->page_run_class;
+		if((size <= MAX_BLOCK_SIZE) && (calculate_size_class(size) == size_class))
+		{
+			return ptr;
+		}
+	}
+	else if((size > MAX_BLOCK_SIZE) && resize_large_block(ptr, entry, size))
+	{
+		return ptr;
+	}
+
+	// a block of an isolated heap moves within that heap
+	processor_heap* owner = (entry->num_pages == 0) ? superblock_owner(entry->owner) : entry->owner;
+	void* mem = (owner->isolated != NULL) ? mm_heap_malloc(owner->isolated, size) : mm_malloc(size);
+	if(mem != NULL)
+	{
+		memcpy(mem, ptr, (size < usable) ? size : usable);
+		mm_free(ptr);
+	}
+
+	return mem;
+}
+
+void *mm_memalign(size_t alignment, size_t size)
+{
+	if((alignment & (alignment - 1)) != 0)
+	{
+		return NULL;
+	}
+
+	// every block size is a multiple of 16 and superblocks are page aligned
+	if(alignment <= 16)
+	{
+		return mm_malloc(size);
+	}
+
+	// past its 128 byte header, a superblock's blocks are aligned to any power of two dividing their size
+	if((alignment <= SUPERBLOCK_HEADER_SIZE) && (size <= MAX_BLOCK_SIZE))
+	{
+		for(unsigned int i = calculate_size_class(size); i < NUM_BLOCK_SIZES; i++)
+		{
+			if(BLOCK_SIZES[i] % alignment == 0)
+			{
+				return alloc_small_block(BLOCK_SIZES[i]);
+			}
+		}
+	}
+
+	// large allocations start on a page, even when they are no bigger than a small block
+	if(alignment <= (size_t) mem_pagesize())
+	{
+		return count_large_alloc(alloc_large_block(get_processor_heap(), (size > 0) ? size : 1, NULL));
+	}
+
+	return count_large_alloc(alloc_aligned_large_block(get_processor_heap(), (size > 0) ? size : 1, alignment, NULL));
+}
+
+// atexit handler enabled by A3ALLOC_FRAGMENTATION_REPORT: prints how much of each size class went unused
+void report_fragmentation(void)
+{
+	fprintf(stderr, "a3alloc internal fragmentation by size class:\n");
+	fprintf(stderr, "%6s %14s %14s %10s\n", "block", "allocations", "avg request", "wasted");
+
+	mm_lock_acquire(&usage_lock, MM_LOCK_MAINTENANCE);
+	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+	{
+		// the exiting thread's own counts have not been folded in yet
+		unsigned long long num_allocations = exited_thread_usage[i].num_allocations + tcache.usage[i].num_allocations;
+		unsigned long long requested_bytes = exited_thread_usage[i].requested_bytes + tcache.usage[i].requested_bytes;
+		if(num_allocations == 0)
+		{
+			continue;
+		}
+
+		double avg_request = (double) requested_bytes / num_allocations;
+		fprintf(stderr, "%6d %14llu %14.1f %9.1f%%\n", BLOCK_SIZES[i], num_allocations, avg_request,
+			100.0 * (1.0 - avg_request / BLOCK_SIZES[i]));
+	}
+	mm_lock_release(&usage_lock);
+}
+
+unsigned int mm_stats_num_heaps(void)
+{
+	return num_processors + 1;
+}
+
+// walks the heap's superblocks and free runs under its lock, the counters themselves are only ever bumped under it
+void heap_stats(processor_heap* heap, mm_heap_stats_t *stats)
+{
+	unsigned long long page_size = mem_pagesize();
+
+	memset(stats, 0, sizeof(mm_heap_stats_t));
+
+	mm_lock_acquire(&heap->lock, MM_LOCK_MAINTENANCE);
+
+	stats->held_bytes = heap->bytes_held;
+	stats->in_use_bytes = heap->bytes_in_use;
+	stats->reserve_bytes = heap->reserve_pages * page_size;
+	for(unsigned int bin = 0; bin < NUM_PAGE_BINS; bin++)
+	{
+		for(free_pages* pages = heap->free_page_bins[bin]; pages != NULL; pages = pages->next)
+		{
+			stats->free_runs++;
+			stats->free_run_bytes += pages->num_pages * page_size;
+		}
+	}
+
+	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+	{
+		mm_class_stats_t* class_stats = &stats->classes[i];
+		class_stats->block_size = BLOCK_SIZES[i];
+		class_stats->refilled = heap->class_counts[i].num_refilled;
+		class_stats->flushed = heap->class_counts[i].num_flushed;
+
+		for(unsigned int group = 0; group <= NUM_FULLNESS_GROUPS; group++)
+		{
+			for(superblock* super_block = heap->fullness_groups[i][group]; super_block != NULL; super_block = super_block->next)
+			{
+				class_stats->superblocks++;
+				class_stats->used_blocks += super_block->num_blocks - super_block->num_free;
+				class_stats->free_blocks += super_block->num_free;
+			}
+		}
+
+		class_stats->used_bytes = class_stats->used_blocks * BLOCK_SIZES[i];
+	}
+
+	mm_lock_release(&heap->lock);
+}
+
+int mm_stats(unsigned int index, mm_heap_stats_t *stats)
+{
+	if((processor_heaps == NULL) || (index > num_processors))
+	{
+		return -1;
+	}
+
+	heap_stats(&processor_heaps[index], stats);
+	return 0;
+}
+
+// an isolated heap has the same layout as the default heaps, its sub-heaps followed by its own global heap
+int mm_heap_stats(mm_heap *heap, unsigned int index, mm_heap_stats_t *stats)
+{
+	if(index > num_processors)
+	{
+		return -1;
+	}
+
+	heap_stats(&heap->heaps[index], stats);
+	return 0;
+}
+
+// sums the counts of the exited threads and of every active thread, whose counts and magazines are read racily
+void mm_call_stats(mm_call_stats_t *stats)
+{
+	memset(stats, 0, sizeof(mm_call_stats_t));
+
+	mm_lock_acquire(&usage_lock, MM_LOCK_MAINTENANCE);
+
+	call_counts totals[NUM_BLOCK_SIZES + 1];
+	memcpy(totals, exited_thread_calls, sizeof(totals));
+
+	for(thread_cache* tc = thread_caches; tc != NULL; tc = tc->next)
+	{
+		for(unsigned int i = 0; i <= NUM_BLOCK_SIZES; i++)
+		{
+			totals[i].num_allocs += tc->calls[i].num_allocs;
+			totals[i].num_frees += tc->calls[i].num_frees;
+			totals[i].num_bytes += tc->calls[i].num_bytes;
+		}
+
+		for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+		{
+			stats->classes[i].cached_blocks += tc->magazines[i].count;
+		}
+	}
+
+	mm_lock_release(&usage_lock);
+
+#ifdef A3ALLOC_RSEQ
+	for(unsigned int cpu = 0; (cpu_caches != NULL) && (cpu < num_cpu_caches); cpu++)
+	{
+		for(unsigned int i = 0; i < NUM_SMALL_BLOCK_SIZES; i++)
+		{
+			stats->classes[i].cached_blocks += cpu_caches[cpu].bins[i].count;
+		}
+	}
+#endif
+
+	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+	{
+		mm_class_calls_t* class_calls = &stats->classes[i];
+		class_calls->block_size = BLOCK_SIZES[i];
+		class_calls->allocs = totals[i].num_allocs;
+		class_calls->frees = totals[i].num_frees;
+		class_calls->live_blocks = totals[i].num_allocs - totals[i].num_frees;
+		class_calls->live_bytes = class_calls->live_blocks * BLOCK_SIZES[i];
+	}
+
+	stats->large_allocs = totals[LARGE_CALLS].num_allocs;
+	stats->large_frees = totals[LARGE_CALLS].num_frees;
+	stats->large_blocks = totals[LARGE_CALLS].num_allocs - totals[LARGE_CALLS].num_frees;
+	stats->large_bytes = totals[LARGE_CALLS].num_bytes;
+}
+
+void mm_stats_print(void)
+{
+	mm_heap_stats_t stats;
+	unsigned long long processor_held = 0, processor_in_use = 0, global_held = 0, global_in_use = 0;
+
+	for(unsigned int i = 0; mm_stats(i, &stats) == 0; i++)
+	{
+		if(i < num_processors)
+		{
+			processor_held += stats.held_bytes;
+			processor_in_use += stats.in_use_bytes;
+		}
+		else
+		{
+			global_held = stats.held_bytes;
+			global_in_use = stats.in_use_bytes;
+		}
+
+		if(i < num_processors)
+		{
+			fprintf(stderr, "a3alloc heap %u:", i);
+		}
+		else
+		{
+			fprintf(stderr, "a3alloc global heap:");
+		}
+
+		fprintf(stderr, " %zu bytes reserved, %zu free runs of %zu bytes\n", stats.reserve_bytes, stats.free_runs,
+			stats.free_run_bytes);
+		fprintf(stderr, "%8s %12s %12s %14s %12s %14s %14s\n", "block", "superblocks", "used", "used bytes", "free",
+			"refilled", "flushed");
+
+		for(unsigned int c = 0; c < MM_STATS_CLASSES; c++)
+		{
+			mm_class_stats_t* class_stats = &stats.classes[c];
+			if((class_stats->superblocks == 0) && (class_stats->refilled == 0))
+			{
+				continue;
+			}
+
+			fprintf(stderr, "%8zu %12zu %12zu %14zu %12zu %14llu %14llu\n", class_stats->block_size,
+				class_stats->superblocks, class_stats->used_blocks, class_stats->used_bytes, class_stats->free_blocks,
+				class_stats->refilled, class_stats->flushed);
+		}
+	}
+
+	// Hoard's emptiness invariant keeps the processor heaps' share close to what is in use, the rest of the
+	// superblocks wait in the global heap
+	fprintf(stderr, "a3alloc blowup: processor heaps hold %llu bytes for %llu in use (%.2fx), global heap %llu for %llu\n",
+		processor_held, processor_in_use, (processor_in_use > 0) ? (double) processor_held / processor_in_use : 0.0,
+		global_held, global_in_use);
+
+	mm_call_stats_t calls;
+	mm_call_stats(&calls);
+
+	fprintf(stderr, "a3alloc calls:\n");
+	fprintf(stderr, "%8s %14s %14s %12s %14s %12s\n", "block", "allocs", "frees", "live", "live bytes", "cached");
+	for(unsigned int c = 0; c < MM_STATS_CLASSES; c++)
+	{
+		mm_class_calls_t* class_calls = &calls.classes[c];
+		if((class_calls->allocs == 0) && (class_calls->frees == 0))
+		{
+			continue;
+		}
+
+		fprintf(stderr, "%8zu %14llu %14llu %12zu %14zu %12zu\n", class_calls->block_size, class_calls->allocs,
+			class_calls->frees, class_calls->live_blocks, class_calls->live_bytes, class_calls->cached_blocks);
+	}
+	fprintf(stderr, "%8s %14llu %14llu %12zu %14zu\n", "large", calls.large_allocs, calls.large_frees,
+		calls.large_blocks, calls.large_bytes);
+}
+
+// writes the heap profile in the text format pprof reads: the totals, then the sampled blocks still live and
+// ever allocated from each call stack, which pprof scales up by the sampling rate, then the mappings to
+// symbolize the stacks with
+int mm_heap_profile_dump(const char *path)
+{
+	if(profile_sample_bytes == 0)
+	{
+		return -1;
+	}
+
+	// stdio allocates, and such an allocation must not be sampled while this thread holds the profile lock
+	long long saved_bytes_until_sample = bytes_until_sample;
+	bytes_until_sample = LLONG_MAX;
+
+	int result = -1;
+	FILE* file = fopen(path, "w");
+	if(file != NULL)
+	{
+		mm_lock_acquire(&profile_lock, MM_LOCK_MAINTENANCE);
+
+		unsigned long long totals[4] = {0, 0, 0, 0};
+		for(unsigned long long i = 0; i < PROFILE_STACK_SLOTS; i++)
+		{
+			if(profile_stacks[i].hash != 0)
+			{
+				totals[0] += profile_stacks[i].live_count;
+				totals[1] += profile_stacks[i].live_bytes;
+				totals[2] += profile_stacks[i].alloc_count;
+				totals[3] += profile_stacks[i].alloc_bytes;
+			}
+		}
+
+		fprintf(file, "heap profile: %llu: %llu [%llu: %llu] @ heap_v2/%llu\n", totals[0], totals[1], totals[2],
+			totals[3], profile_sample_bytes);
+
+		for(unsigned long long i = 0; i < PROFILE_STACK_SLOTS; i++)
+		{
+			profile_stack* stack = &profile_stacks[i];
+			if(stack->hash == 0)
+			{
+				continue;
+			}
+
+			fprintf(file, "%llu: %llu [%llu: %llu] @", stack->live_count, stack->live_bytes, stack->alloc_count,
+				stack->alloc_bytes);
+			for(unsigned int f = 0; f < stack->depth; f++)
+			{
+				fprintf(file, " %p", stack->frames[f]);
+			}
+			fprintf(file, "\n");
+		}
+
+		mm_lock_release(&profile_lock);
+
+		fprintf(file, "\nMAPPED_LIBRARIES:\n");
+		int maps = open("/proc/self/maps", O_RDONLY);
+		if(maps >= 0)
+		{
+			char buffer[4096];
+			ssize_t length;
+			while((length = read(maps, buffer, sizeof(buffer))) > 0)
+			{
+				fwrite(buffer, 1, length, file);
+			}
+			close(maps);
+		}
+
+		result = (fclose(file) == 0) ? 0 : -1;
+	}
+
+	bytes_until_sample = saved_bytes_until_sample;
+	return result;
+}
+
+// atexit handler enabled by A3ALLOC_HEAP_PROFILE
+void dump_heap_profile(void)
+{
+	if(mm_heap_profile_dump(profile_path) != 0)
+	{
+		fprintf(stderr, "a3alloc: could not write the heap profile to %s\n", profile_path);
+	}
+}
+
+// moves events out of the rings of every thread, the rings' owners keep recording meanwhile
+size_t mm_trace_drain(mm_trace_event_t *events, size_t max)
+{
+	size_t count = 0;
+
+	mm_lock_acquire(&trace_drain_lock, MM_LOCK_MAINTENANCE);
+	for(trace_ring* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); (ring != NULL) && (count < max); ring = ring->next)
+	{
+		unsigned long long tail = ring->tail;
+		unsigned long long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for(; (tail != head) && (count < max); tail++)
+		{
+			events[count++] = ring->events[tail & (TRACE_RING_SIZE - 1)];
+		}
+
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+	mm_lock_release(&trace_drain_lock);
+
+	return count;
+}
+
+unsigned long long mm_trace_dropped(void)
+{
+	unsigned long long dropped = 0;
+
+	for(trace_ring* ring = __atomic_load_n(&trace_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+	{
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+	}
+
+	return dropped;
+}
+
+void mm_trace_print(void)
+{
+	mm_trace_event_t events[64];
+	size_t count;
+
+	fprintf(stderr, "a3alloc slow calls (ns):\n");
+	fprintf(stderr, "%14s %8s %6s %10s %10s %10s %10s %10s %10s %10s %10s %6s %4s\n", "time", "thread", "op", "size",
+		"total", "lock wait", "remote", "page find", "page free", "sbrk", "purge", "walk", "grew");
+
+	while((count = mm_trace_drain(events, 64)) > 0)
+	{
+		for(size_t i = 0; i < count; i++)
+		{
+			mm_trace_event_t* event = &events[i];
+			fprintf(stderr, "%14llu %8u %6s %10zu %10u %10u %10u %10u %10u %10u %10u %6u %4s\n", event->timestamp_ns,
+				event->thread, (event->op == MM_TRACE_MALLOC) ? "malloc" : "free", event->size, event->total_ns,
+				event->phase_ns[MM_TRACE_LOCK_WAIT], event->phase_ns[MM_TRACE_REMOTE_DRAIN],
+				event->phase_ns[MM_TRACE_PAGE_SEARCH], event->phase_ns[MM_TRACE_PAGE_FREE], event->phase_ns[MM_TRACE_SBRK],
+				event->phase_ns[MM_TRACE_PURGE], event->walk_length, event->grew ? "yes" : "no");
+		}
+	}
+
+	fprintf(stderr, "%llu slow calls dropped by full rings\n", mm_trace_dropped());
+}
+
+// gives the global heap every completely free superblock of a heap (the heap lock must be held)
+void release_empty_superblocks(processor_heap* heap)
+{
+	for(unsigned int i = 0; i < NUM_BLOCK_SIZES; i++)
+	{
+		superblock* super_block = heap->fullness_groups[i][0];
+		while(super_block != NULL)
+		{
+			superblock* next = super_block->next;
+			if(super_block->num_free == super_block->num_blocks)
+			{
+				release_superblock(heap, super_block);
+			}
+
+			super_block = next;
+		}
+	}
+}
+
+// purges the decayed runs of a family of processor heaps and their global heap
+void purge_decayed_pages(processor_heap* heaps)
+{
+	for(unsigned int i = 0; i <= num_processors; i++)
+	{
+		mm_lock_acquire(&heaps[i].lock, MM_LOCK_MAINTENANCE);
+		purge_heap_pages(&heaps[i], current_time(), 0);
+		mm_lock_release(&heaps[i].lock);
+	}
+}
+
+// wakes up twice per decay period to purge the runs nobody freed pages next to in the meantime
+void* background_purge(void* arg)
+{
+	struct timespec period;
+	period.tv_sec = (time_t) (purge_decay / 2);
+	period.tv_nsec = (long) ((purge_decay / 2 - period.tv_sec) * 1000000000.0);
+
+	while(1)
+	{
+		nanosleep(&period, NULL);
+
+		purge_decayed_pages(processor_heaps);
+
+		mm_lock_acquire(&isolated_heaps_lock, MM_LOCK_MAINTENANCE);
+		for(mm_heap* heap = isolated_heaps; heap != NULL; heap = heap->next)
+		{
+			purge_decayed_pages(heap->heaps);
+		}
+		mm_lock_release(&isolated_heaps_lock);
+	}
+
+	return arg;
+}
+
+void start_background_purge(void)
+{
+	if((purge_decay > 0) && (getenv("A3ALLOC_BACKGROUND_PURGE") != NULL))
+	{
+		pthread_t purge_thread;
+		if(pthread_create(&purge_thread, NULL, background_purge, NULL) == 0)
+		{
+			pthread_detach(purge_thread);
+		}
+	}
+}
+
+void lock_heaps(processor_heap* heaps)
+{
+	for(unsigned int i = 0; i <= num_processors; i++)
+	{
+		mm_lock_acquire(&heaps[i].lock, MM_LOCK_MAINTENANCE);
+	}
+}
+
+void unlock_heaps(processor_heap* heaps)
+{
+	for(unsigned int i = num_processors + 1; i-- > 0;)
+	{
+		mm_lock_release(&heaps[i].lock);
+	}
+}
+
+// takes every allocator lock before a fork, in the order the allocation paths take them
+void lock_all_heaps(void)
+{
+	mm_lock_acquire(&profile_lock, MM_LOCK_MAINTENANCE);
+	mm_lock_acquire(&object_caches_lock, MM_LOCK_MAINTENANCE);
+	for(mm_cache* cache = object_caches; cache != NULL; cache = cache->next)
+	{
+		for(unsigned int i = 0; i < num_processors; i++)
+		{
+			mm_lock_acquire(&cache->magazines[i].lock, MM_LOCK_MAINTENANCE);
+		}
+		mm_lock_acquire(&cache->lock, MM_LOCK_MAINTENANCE);
+	}
+
+	mm_lock_acquire(&isolated_heaps_lock, MM_LOCK_MAINTENANCE);
+	for(mm_heap* heap = isolated_heaps; heap != NULL; heap = heap->next)
+	{
+		lock_heaps(heap->heaps);
+	}
+
+	lock_heaps(processor_heaps);
+	mm_lock_acquire(&usage_lock, MM_LOCK_MAINTENANCE);
+}
+
+void unlock_all_heaps(void)
+{
+	mm_lock_release(&usage_lock);
+	unlock_heaps(processor_heaps);
+
+	for(mm_heap* heap = isolated_heaps; heap != NULL; heap = heap->next)
+	{
+		unlock_heaps(heap->heaps);
+	}
+	mm_lock_release(&isolated_heaps_lock);
+
+	for(mm_cache* cache = object_caches; cache != NULL; cache = cache->next)
+	{
+		mm_lock_release(&cache->lock);
+		for(unsigned int i = num_processors; i-- > 0;)
+		{
+			mm_lock_release(&cache->magazines[i].lock);
+		}
+	}
+	mm_lock_release(&object_caches_lock);
+	mm_lock_release(&profile_lock);
+}
+
+// the child only has the forking thread, so the purge thread has to be started again
+void reset_after_fork(void)
+{
+	// the other threads' caches are left behind along with their blocks, only their counts are kept
+	for(thread_cache* tc = thread_caches; tc != NULL;)
+	{
+		thread_cache* next = tc->next;
+		if(tc != &tcache)
+		{
+			fold_thread_calls(tc);
+		}
+		tc = next;
+	}
+
+	unlock_all_heaps();
+	start_background_purge();
+}
+
+// purges every free run and empty superblock of a family of processor heaps and their global heap
+void trim_heaps(processor_heap* heaps)
+{
+	processor_heap* global = &heaps[num_processors];
+
+	for(unsigned int i = 0; i < num_processors; i++)
+	{
+		processor_heap* heap = &heaps[i];
+
+		mm_lock_acquire(&heap->lock, MM_LOCK_MAINTENANCE);
+		drain_remote_frees(heap);
+		release_empty_superblocks(heap);
+		purge_heap_pages(heap, current_time(), 1);
+		mm_lock_release(&heap->lock);
+	}
+
+	mm_lock_acquire(&global->lock, MM_LOCK_MAINTENANCE);
+	drain_remote_frees(global);
+	purge_heap_pages(global, current_time(), 1);
+	mm_lock_release(&global->lock);
+}
+
+void mm_trim(void)
+{
+	if(processor_heaps == NULL)
+	{
+		return;
+	}
+
+	// reaped first, so the slabs they free are purged below
+	mm_lock_acquire(&object_caches_lock, MM_LOCK_MAINTENANCE);
+	for(mm_cache* cache = object_caches; cache != NULL; cache = cache->next)
+	{
+		reap_cache(cache);
+	}
+	mm_lock_release(&object_caches_lock);
+
+	trim_heaps(processor_heaps);
+
+	mm_lock_acquire(&isolated_heaps_lock, MM_LOCK_MAINTENANCE);
+	for(mm_heap* heap = isolated_heaps; heap != NULL; heap = heap->next)
+	{
+		trim_heaps(heap->heaps);
+	}
+	mm_lock_release(&isolated_heaps_lock);
+}
+
+unsigned long long mm_remote_free_count(void)
+{
+	unsigned long long count = 0;
+
+	for(unsigned int i = 0; i <= num_processors; i++)
+	{
+		count += __atomic_load_n(&processor_heaps[i].num_remote_frees, __ATOMIC_RELAXED);
+	}
+
+	return count;
+}
+
+int mm_init(void)
+{
+	if(__atomic_load_n(&initialized, __ATOMIC_ACQUIRE))
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&init_lock);
+
+	// another thread may have finished initializing while we waited for the lock
+	int result = 0;
+	if(!initialized)
+	{
+		result = mem_init();
+		if(result == 0)
+		{
+			result = initialize();
+		}
+
+		__atomic_store_n(&initialized, result == 0, __ATOMIC_RELEASE);
+	}
+
+	pthread_mutex_unlock(&init_lock);
+	return result;
 }
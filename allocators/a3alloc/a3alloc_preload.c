@@ -0,0 +1,256 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "a3alloc.h"
+#include "mm_record.h"
+
+// Interposes the C library allocation functions with a3alloc when built into liba3alloc.so and
+// loaded with LD_PRELOAD. Setting A3ALLOC_RECORD to a file name records the calls into an allocation
+// trace there (see mm_record.h) for benchmarks/replay.
+
+#define BOOTSTRAP_HEAP_SIZE (64 * 1024)
+
+// allocations made while a3alloc is initializing itself (get_nprocs, pthread_create, atexit...) are served
+// from a static buffer, they are never freed
+typedef struct bootstrap_allocation_t
+{
+	size_t size;
+	size_t padding;
+} bootstrap_allocation;
+
+unsigned char bootstrap_heap[BOOTSTRAP_HEAP_SIZE] __attribute__((aligned(16)));
+size_t bootstrap_used;
+
+int preload_ready;
+__thread int preload_initializing;
+
+int is_bootstrap_pointer(void* ptr)
+{
+	return ((unsigned char*) ptr >= bootstrap_heap) && ((unsigned char*) ptr < bootstrap_heap + BOOTSTRAP_HEAP_SIZE);
+}
+
+void* bootstrap_malloc(size_t size)
+{
+	size_t total = sizeof(bootstrap_allocation) + ((size + 15) & ~(size_t) 15);
+	size_t offset = __atomic_fetch_add(&bootstrap_used, total, __ATOMIC_RELAXED);
+	if((size > BOOTSTRAP_HEAP_SIZE) || (offset + total > BOOTSTRAP_HEAP_SIZE))
+	{
+		return NULL;
+	}
+
+	bootstrap_allocation* allocation = (bootstrap_allocation*) (bootstrap_heap + offset);
+	allocation->size = size;
+	return allocation + 1;
+}
+
+size_t bootstrap_size(void* ptr)
+{
+	return ((bootstrap_allocation*) ptr - 1)->size;
+}
+
+// returns 0 when the caller has to fall back to the bootstrap heap, because the allocator is initializing
+// on this thread (or failed to)
+int ensure_initialized(void)
+{
+	if(__builtin_expect(__atomic_load_n(&preload_ready, __ATOMIC_ACQUIRE), 1))
+	{
+		return 1;
+	}
+
+	if(preload_initializing)
+	{
+		return 0;
+	}
+
+	preload_initializing = 1;
+	int result = mm_init();
+	const char* record_path = getenv("A3ALLOC_RECORD");
+	if((result == 0) && (record_path != NULL) && (*record_path != '\0'))
+	{
+		mm_record_start(record_path);
+	}
+	preload_initializing = 0;
+
+	if(result != 0)
+	{
+		return 0;
+	}
+
+	__atomic_store_n(&preload_ready, 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+void* malloc(size_t size)
+{
+	if(!ensure_initialized())
+	{
+		void* mem = bootstrap_malloc(size);
+		if(mem == NULL)
+		{
+			errno = ENOMEM;
+		}
+
+		return mem;
+	}
+
+	void* mem = mm_malloc(size);
+	if(mem == NULL)
+	{
+		errno = ENOMEM;
+	}
+	else if(__builtin_expect(mm_recording, 0))
+	{
+		mm_record_alloc(MM_RECORD_MALLOC, mem, size);
+	}
+
+	return mem;
+}
+
+void free(void* ptr)
+{
+	if((ptr == NULL) || is_bootstrap_pointer(ptr))
+	{
+		return;
+	}
+
+	if(__builtin_expect(mm_recording, 0))
+	{
+		mm_record_free(ptr);
+	}
+
+	mm_free(ptr);
+}
+
+void* calloc(size_t nmemb, size_t size)
+{
+	void* mem = NULL;
+	if(ensure_initialized())
+	{
+		mem = mm_calloc(nmemb, size);
+		if((mem != NULL) && __builtin_expect(mm_recording, 0))
+		{
+			mm_record_alloc(MM_RECORD_CALLOC, mem, nmemb * size);
+		}
+	}
+	else if(!__builtin_mul_overflow(nmemb, size, &size))
+	{
+		// the static buffer is still zero since it is never reused
+		mem = bootstrap_malloc(size);
+	}
+
+	if(mem == NULL)
+	{
+		errno = ENOMEM;
+	}
+
+	return mem;
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	if((ptr == NULL) || !is_bootstrap_pointer(ptr))
+	{
+		if(!ensure_initialized())
+		{
+			return bootstrap_malloc(size);
+		}
+
+		unsigned long long object = 0;
+		int recording = mm_recording;
+		if(__builtin_expect(recording, 0))
+		{
+			object = mm_record_realloc_begin(ptr);
+		}
+
+		void* mem = mm_realloc(ptr, size);
+		if((mem == NULL) && (size != 0))
+		{
+			errno = ENOMEM;
+		}
+
+		if(__builtin_expect(recording, 0))
+		{
+			mm_record_realloc_end(object, ptr, mem, size);
+		}
+
+		return mem;
+	}
+
+	// blocks of the bootstrap heap move to a3alloc (or to the bootstrap heap while it is still initializing)
+	void* mem = malloc(size);
+	if(mem != NULL)
+	{
+		size_t old_size = bootstrap_size(ptr);
+		memcpy(mem, ptr, (size < old_size) ? size : old_size);
+	}
+
+	return mem;
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+	if(!ensure_initialized())
+	{
+		return (alignment <= 16) ? bootstrap_malloc(size) : NULL;
+	}
+
+	void* mem = mm_memalign(alignment, size);
+	if(mem == NULL)
+	{
+		errno = ((alignment & (alignment - 1)) != 0) ? EINVAL : ENOMEM;
+	}
+	else if(__builtin_expect(mm_recording, 0))
+	{
+		// traces have no alignments, replays allocate these like any other object
+		mm_record_alloc(MM_RECORD_MALLOC, mem, size);
+	}
+
+	return mem;
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size)
+{
+	if(((alignment & (alignment - 1)) != 0) || (alignment % sizeof(void*) != 0))
+	{
+		return EINVAL;
+	}
+
+	void* mem = memalign(alignment, size);
+	if(mem == NULL)
+	{
+		return ENOMEM;
+	}
+
+	*memptr = mem;
+	return 0;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	return memalign(alignment, size);
+}
+
+void* valloc(size_t size)
+{
+	return memalign(getpagesize(), size);
+}
+
+void* pvalloc(size_t size)
+{
+	size_t page_size = getpagesize();
+	return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+}
+
+size_t malloc_usable_size(void* ptr)
+{
+	if((ptr == NULL) || is_bootstrap_pointer(ptr))
+	{
+		return (ptr == NULL) ? 0 : bootstrap_size(ptr);
+	}
+
+	return mm_usable_size(ptr);
+}
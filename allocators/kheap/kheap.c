@@ -1,12 +1,17 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 #include <assert.h>
+#include <limits.h>
+#include <stdint.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
 #include "memlib.h"
+#include "mm_lock.h"
 #include "malloc.h"
 
 name_t myname = {
@@ -285,6 +290,30 @@ int blocktype(size_t sz)
 	return 0;
 }
 
+/*
+ * Size of the subpage block ptr points into, or 0 if it is not on any
+ * of our subpage pages. Same nasty search as subpage_kfree.
+ */
+static
+size_t
+subpage_blocksize(void *ptr)
+{
+	vaddr_t ptraddr = (vaddr_t)ptr;
+	struct pageref *pr;
+	int i;
+
+	for (i=0; i<NSIZES; i++) {
+		for (pr = sizebases[i]; pr; pr = pr->next) {
+			vaddr_t prpage = PR_PAGEADDR(pr);
+			if (ptraddr >= prpage && ptraddr < prpage + PAGE_SIZE) {
+				return sizes[PR_BLOCKTYPE(pr)];
+			}
+		}
+	}
+
+	return 0;
+}
+
 static
 void *
 subpage_kmalloc(size_t sz)
@@ -508,6 +537,12 @@ static void *big_kmalloc(int sz)
 	return result;
 }
 
+static size_t big_blocksize(void *ptr)
+{
+	int *hdr_ptr = (int *)((char *)ptr - SMALLEST_SUBPAGE_SIZE);
+	return *hdr_ptr * PAGE_SIZE - SMALLEST_SUBPAGE_SIZE;
+}
+
 static void big_kfree(void *ptr)
 {
 	/* Coalescing is unlikely to do much good (other page allocations
@@ -524,25 +559,57 @@ static void big_kfree(void *ptr)
 	bigchunks = newfree;
 }
 
+/*
+ * Give the memory of completely free pages back to the OS. Recycled
+ * subpage pages get their free list rebuilt when they are reused, and
+ * big chunks only need the page holding their header, so everything
+ * else can be dropped.
+ */
+static void trim_free_pages(void)
+{
+	struct pageref *pr;
+	struct big_freelist *chunk;
+
+	for (pr = recycled_refs; pr != NULL; pr = pr->next) {
+		if (PR_PAGEADDR(pr) != 0) {
+			mem_release((void *)PR_PAGEADDR(pr), PAGE_SIZE, 
+				    MADV_DONTNEED);
+		}
+	}
+
+	for (chunk = bigchunks; chunk != NULL; chunk = chunk->next) {
+		mem_release((char *)chunk + PAGE_SIZE, 
+			    (chunk->npages - 1) * PAGE_SIZE, MADV_DONTNEED);
+	}
+}
+
 //
 ////////////////////////////////////////////////////////////
 
-pthread_mutex_t malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+mm_lock_t malloc_lock = MM_LOCK_INITIALIZER;
 
 int mm_init(void)
 {
 	if (dseg_lo == NULL && dseg_hi == NULL) {
+		mm_lock_init(&malloc_lock, "malloc_lock");
 		return mem_init();
 	}
 	return 0;
 }
 
+static
+enum mm_lock_path
+alloc_path(size_t sz)
+{
+	return (sz >= LARGEST_SUBPAGE_SIZE) ? MM_LOCK_LARGE_ALLOC : MM_LOCK_SMALL_ALLOC;
+}
+
 void *
 mm_malloc(size_t sz)
 {
 	void *result;
 
-	pthread_mutex_lock(&malloc_lock);
+	mm_lock_acquire(&malloc_lock, alloc_path(sz));
 
 	if (sz>=LARGEST_SUBPAGE_SIZE) {
 		result = big_kmalloc(sz);
@@ -550,7 +617,7 @@ mm_malloc(size_t sz)
 		result = subpage_kmalloc(sz);
 	}
 
-	pthread_mutex_unlock(&malloc_lock);
+	mm_lock_release(&malloc_lock);
 
 	return result;
 }
@@ -564,11 +631,290 @@ mm_free(void *ptr)
 	if (ptr == NULL) {
 		return;
 	} else {
-	  pthread_mutex_lock(&malloc_lock);
+	  /* counted as a small free, since that is tried first */
+	  mm_lock_acquire(&malloc_lock, MM_LOCK_SMALL_FREE);
 	  if (subpage_kfree(ptr)) {
 		  big_kfree(ptr);
 	  }
-	  pthread_mutex_unlock(&malloc_lock);
+	  mm_lock_release(&malloc_lock);
+	}
+}
+
+void
+mm_trim(void)
+{
+	mm_lock_acquire(&malloc_lock, MM_LOCK_MAINTENANCE);
+	trim_free_pages();
+	mm_lock_release(&malloc_lock);
+}
+
+/*
+ * The size tells us which allocator the block came from, so unlike
+ * mm_free this never has to search the subpage lists for big blocks.
+ */
+void
+mm_free_sized(void *ptr, size_t size)
+{
+	if (ptr == NULL) {
+		return;
+	}
+
+	mm_lock_acquire(&malloc_lock, (size >= LARGEST_SUBPAGE_SIZE) ?
+	    MM_LOCK_LARGE_FREE : MM_LOCK_SMALL_FREE);
+	if (size >= LARGEST_SUBPAGE_SIZE) {
+		big_kfree(ptr);
+	} else {
+		subpage_kfree(ptr);
+	}
+	mm_lock_release(&malloc_lock);
+}
+
+/*
+ * The batch calls only save taking malloc_lock once per block.
+ */
+size_t
+mm_malloc_batch(size_t size, size_t n, void **out)
+{
+	size_t count;
+
+	mm_lock_acquire(&malloc_lock, alloc_path(size));
+	for (count = 0; count < n; count++) {
+		if (size >= LARGEST_SUBPAGE_SIZE) {
+			out[count] = big_kmalloc(size);
+		} else {
+			out[count] = subpage_kmalloc(size);
+		}
+		if (out[count] == NULL) {
+			break;
+		}
+	}
+	mm_lock_release(&malloc_lock);
+
+	return count;
+}
+
+void
+mm_free_batch(void **ptrs, size_t n)
+{
+	size_t i;
+
+	mm_lock_acquire(&malloc_lock, MM_LOCK_SMALL_FREE);
+	for (i = 0; i < n; i++) {
+		if (ptrs[i] != NULL && subpage_kfree(ptrs[i])) {
+			big_kfree(ptrs[i]);
+		}
+	}
+	mm_lock_release(&malloc_lock);
+}
+
+/*
+ * Arenas bump allocate out of chunks taken from big_kmalloc, with a
+ * chunk of its own for any object too big for the chunk size.
+ */
+#define ARENA_CHUNK_SIZE (16 * PAGE_SIZE)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+struct mm_arena {
+	char *cursor;
+	char *limit;
+	struct arena_chunk *chunks;	/* current chunk first */
+};
+
+/*
+ * big_kmalloc blocks are only word aligned, so objects start at the
+ * first aligned address past the chunk header.
+ */
+static
+char *
+arena_chunk_start(struct arena_chunk *chunk)
+{
+	uintptr_t start;
+
+	start = (uintptr_t)(chunk + 1);
+	return (char *)((start + ARENA_ALIGN - 1) & ~(uintptr_t)(ARENA_ALIGN - 1));
+}
+
+mm_arena *
+mm_arena_create(void)
+{
+	mm_arena *arena;
+
+	arena = mm_malloc(sizeof(mm_arena));
+	if (arena != NULL) {
+		memset(arena, 0, sizeof(mm_arena));
 	}
+	return arena;
 }
 
+void *
+mm_arena_alloc(mm_arena *arena, size_t size)
+{
+	struct arena_chunk *chunk;
+	size_t chunksize;
+	void *result;
+
+	/* big_kmalloc takes an int */
+	if (size > INT_MAX - ARENA_CHUNK_SIZE) {
+		return NULL;
+	}
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (size == 0) {
+		size = ARENA_ALIGN;
+	}
+	if (size <= (size_t)(arena->limit - arena->cursor)) {
+		result = arena->cursor;
+		arena->cursor += size;
+		return result;
+	}
+
+	chunksize = sizeof(struct arena_chunk) + ARENA_ALIGN + size;
+	if (chunksize < ARENA_CHUNK_SIZE) {
+		chunksize = ARENA_CHUNK_SIZE;
+	}
+
+	mm_lock_acquire(&malloc_lock, MM_LOCK_LARGE_ALLOC);
+	chunk = big_kmalloc(chunksize);
+	mm_lock_release(&malloc_lock);
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	chunk->next = arena->chunks;
+	arena->chunks = chunk;
+	result = arena_chunk_start(chunk);
+	if (chunksize == ARENA_CHUNK_SIZE) {
+		/* only standard chunks become the current chunk */
+		arena->cursor = (char *)result + size;
+		arena->limit = (char *)chunk + chunksize;
+	}
+	return result;
+}
+
+static
+void
+free_arena_chunks(struct arena_chunk *chunk, struct arena_chunk *keep)
+{
+	struct arena_chunk *next;
+
+	mm_lock_acquire(&malloc_lock, MM_LOCK_LARGE_FREE);
+	for (; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		if (chunk != keep) {
+			big_kfree(chunk);
+		}
+	}
+	mm_lock_release(&malloc_lock);
+}
+
+void
+mm_arena_reset(mm_arena *arena)
+{
+	struct arena_chunk *keep;
+
+	/* keep the current chunk if it is a standard one */
+	keep = NULL;
+	if (arena->chunks != NULL &&
+	    arena->limit == (char *)arena->chunks + ARENA_CHUNK_SIZE) {
+		keep = arena->chunks;
+	}
+	free_arena_chunks(arena->chunks, keep);
+
+	arena->chunks = keep;
+	if (keep != NULL) {
+		keep->next = NULL;
+		arena->cursor = arena_chunk_start(keep);
+	} else {
+		arena->cursor = arena->limit = NULL;
+	}
+}
+
+void
+mm_arena_destroy(mm_arena *arena)
+{
+	if (arena == NULL) {
+		return;
+	}
+	free_arena_chunks(arena->chunks, NULL);
+	mm_free(arena);
+}
+
+size_t
+mm_usable_size(void *ptr)
+{
+	size_t size;
+
+	if (ptr == NULL) {
+		return 0;
+	}
+
+	mm_lock_acquire(&malloc_lock, MM_LOCK_MAINTENANCE);
+	size = subpage_blocksize(ptr);
+	if (size == 0) {
+		size = big_blocksize(ptr);
+	}
+	mm_lock_release(&malloc_lock);
+
+	return size;
+}
+
+void *
+mm_calloc(size_t nmemb, size_t size)
+{
+	void *result;
+	size_t total;
+
+	if (__builtin_mul_overflow(nmemb, size, &total)) {
+		return NULL;
+	}
+
+	result = mm_malloc(total);
+	if (result != NULL) {
+		memset(result, 0, total);
+	}
+	return result;
+}
+
+/*
+ * Blocks are only ever resized in place when the new size still fits
+ * in the block (subpage blocks are rounded up to a power of two and big
+ * ones to whole pages) and mm_malloc would have used the same allocator
+ * for it, so that mm_free_sized keeps working.
+ */
+void *
+mm_realloc(void *ptr, size_t size)
+{
+	void *result;
+	size_t oldsize;
+	int was_big;
+
+	if (ptr == NULL) {
+		return mm_malloc(size);
+	}
+	if (size == 0) {
+		mm_free(ptr);
+		return NULL;
+	}
+
+	mm_lock_acquire(&malloc_lock, MM_LOCK_MAINTENANCE);
+	oldsize = subpage_blocksize(ptr);
+	was_big = (oldsize == 0);
+	if (was_big) {
+		oldsize = big_blocksize(ptr);
+	}
+	mm_lock_release(&malloc_lock);
+
+	if (size <= oldsize && was_big == (size >= LARGEST_SUBPAGE_SIZE)) {
+		return ptr;
+	}
+
+	result = mm_malloc(size);
+	if (result != NULL) {
+		memcpy(result, ptr, size < oldsize ? size : oldsize);
+		mm_free(ptr);
+	}
+	return result;
+}
@@ -1,5 +1,11 @@
+#include <stdint.h>
 #include <stdlib.h>
 #include "memlib.h"
+#include "malloc.h"
+
+/* glibc's <malloc.h> is shadowed by ours */
+extern int malloc_trim(size_t pad);
+extern size_t malloc_usable_size(void *ptr);
 
 void *mm_malloc(size_t sz)
 {
@@ -11,6 +17,132 @@ void mm_free(void *ptr)
   free(ptr);
 }
 
+void *mm_calloc(size_t nmemb, size_t size)
+{
+  return calloc(nmemb, size);
+}
+
+void *mm_realloc(void *ptr, size_t size)
+{
+  return realloc(ptr, size);
+}
+
+size_t mm_usable_size(void *ptr)
+{
+  return malloc_usable_size(ptr);
+}
+
+void mm_free_sized(void *ptr, size_t size)
+{
+  (void) size;
+  free(ptr);
+}
+
+size_t mm_malloc_batch(size_t size, size_t n, void **out)
+{
+  size_t count = 0;
+  while (count < n && (out[count] = malloc(size)) != NULL)
+    count++;
+  return count;
+}
+
+void mm_free_batch(void **ptrs, size_t n)
+{
+  for (size_t i = 0; i < n; i++)
+    free(ptrs[i]);
+}
+
+/* Arenas bump allocate out of malloc'd chunks, with a chunk of its own
+   for any object too big for the chunk size. */
+#define ARENA_CHUNK_SIZE 65536
+#define ARENA_ALIGN 16
+
+struct arena_chunk
+{
+  struct arena_chunk *next;
+  char pad[ARENA_ALIGN - sizeof(struct arena_chunk *)];
+};
+
+struct mm_arena
+{
+  char *cursor;
+  char *limit;
+  struct arena_chunk *chunks;	/* current chunk first */
+};
+
+mm_arena *mm_arena_create(void)
+{
+  return calloc(1, sizeof(mm_arena));
+}
+
+void *mm_arena_alloc(mm_arena *arena, size_t size)
+{
+  if (size > SIZE_MAX - ARENA_CHUNK_SIZE)
+    return NULL;
+  size = size == 0 ? ARENA_ALIGN : (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+  if (size <= (size_t)(arena->limit - arena->cursor))
+    {
+      void *result = arena->cursor;
+      arena->cursor += size;
+      return result;
+    }
+
+  size_t chunksize = sizeof(struct arena_chunk) + size;
+  if (chunksize < ARENA_CHUNK_SIZE)
+    chunksize = ARENA_CHUNK_SIZE;
+  struct arena_chunk *chunk = malloc(chunksize);
+  if (chunk == NULL)
+    return NULL;
+
+  chunk->next = arena->chunks;
+  arena->chunks = chunk;
+  /* only standard chunks become the current chunk */
+  if (chunksize == ARENA_CHUNK_SIZE)
+    {
+      arena->cursor = (char *)(chunk + 1) + size;
+      arena->limit = (char *)chunk + chunksize;
+    }
+  return chunk + 1;
+}
+
+void mm_arena_reset(mm_arena *arena)
+{
+  struct arena_chunk *keep = NULL;
+  if (arena->chunks != NULL && arena->limit == (char *)arena->chunks + ARENA_CHUNK_SIZE)
+    keep = arena->chunks;
+
+  struct arena_chunk *chunk, *next;
+  for (chunk = arena->chunks; chunk != NULL; chunk = next)
+    {
+      next = chunk->next;
+      if (chunk != keep)
+        free(chunk);
+    }
+
+  arena->chunks = keep;
+  if (keep != NULL)
+    {
+      keep->next = NULL;
+      arena->cursor = (char *)(keep + 1);
+    }
+  else
+    arena->cursor = arena->limit = NULL;
+}
+
+void mm_arena_destroy(mm_arena *arena)
+{
+  if (arena == NULL)
+    return;
+  arena->limit = NULL;
+  mm_arena_reset(arena);
+  free(arena);
+}
+
+void mm_trim(void)
+{
+  malloc_trim(0);
+}
+
 
 int mm_init(void)
 {
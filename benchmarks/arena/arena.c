@@ -0,0 +1,153 @@
+/**
+ * @file arena.c
+ *
+ * Request-lifetime benchmark for the arena calls. Each thread handles
+ * a stream of requests, each allocating a number of objects of random
+ * sizes that all die when the request ends. The requests are run once
+ * with mm_malloc/mm_free and once with a per-thread arena that is
+ * reset at the end of every request, and the cost per request of both
+ * is reported.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "perf_counter.h"
+
+int nthreads = 1;	// Default number of threads.
+int nrequests = 100000;	// Default number of requests per thread.
+int nobjects = 50;	// Default number of objects per request.
+int maxsize = 256;	// Default largest object size.
+int use_arena;		// Which pass the workers run.
+
+extern void * worker (void *arg)
+{
+	int i, j;
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+	int cpu = (int)arg; // cpu number will fit in an int, ignore warning
+#pragma GCC diagnostic pop
+	unsigned int seed = cpu + 1;
+
+	setCPU(cpu);
+
+	void ** a = (void **)mm_malloc(nobjects * sizeof(void *));
+	mm_arena * arena = use_arena ? mm_arena_create() : NULL;
+
+	for (j = 0; j < nrequests; j++) {
+		for (i = 0; i < nobjects; i++) {
+			size_t sz = 8 + rand_r(&seed) % maxsize;
+			a[i] = use_arena ? mm_arena_alloc(arena, sz) : mm_malloc(sz);
+			assert (a[i]);
+			memset(a[i], i, 8);
+		}
+
+		/* The request is over */
+		if (use_arena) {
+			mm_arena_reset(arena);
+		} else {
+			for (i = 0; i < nobjects; i++) {
+				mm_free(a[i]);
+			}
+		}
+	}
+
+	mm_arena_destroy(arena);
+	mm_free(a);
+
+	return NULL;
+}
+
+double run_pass (pthread_attr_t *attr, int numCPU, long long *dtlb_misses)
+{
+	struct timespec start_time;
+	struct timespec end_time;
+	int i;
+
+	pthread_t *threads = (pthread_t *)mm_malloc(nthreads*sizeof(pthread_t));
+
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
+
+	/* Get the starting time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], attr, &worker, (void *)((u_int64_t)(i+1)%numCPU));
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* Get the finish time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	*dtlb_misses = dtlb_counter_read(dtlb_fd);
+
+	mm_free(threads);
+
+	return timespec_diff(&start_time, &end_time);
+}
+
+void print_dtlb_misses (const char *pass, long long dtlb_misses)
+{
+	if (dtlb_misses >= 0) {
+		printf ("%s dTLB misses = %lld\n", pass, dtlb_misses);
+	} else {
+		printf ("%s dTLB misses = unavailable\n", pass);
+	}
+}
+
+int main (int argc, char * argv[])
+{
+	if (argc >= 2) {
+		nthreads = atoi(argv[1]);
+	}
+
+	if (argc >= 3) {
+		nrequests = atoi(argv[2]);
+	}
+
+	if (argc >= 4) {
+		nobjects = atoi(argv[3]);
+	}
+
+	if (argc >= 5) {
+		maxsize = atoi(argv[4]);
+	}
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	int numCPU = getNumProcessors();
+
+	pthread_attr_t attr;
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	printf ("Running arena for %d threads, %d requests, %d objects per request and %d maximum size...\n", nthreads, nrequests, nobjects, maxsize);
+
+	double requests = (double)nthreads * nrequests;
+
+	long long single_dtlb, arena_dtlb;
+
+	use_arena = 0;
+	double single = run_pass(&attr, numCPU, &single_dtlb);
+	printf ("mm_malloc/mm_free: %f seconds, %.1f ns per request\n", single, single * 1e9 / requests);
+
+	use_arena = 1;
+	double arena = run_pass(&attr, numCPU, &arena_dtlb);
+	printf ("Arena: %f seconds, %.1f ns per request\n", arena, arena * 1e9 / requests);
+
+	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	print_dtlb_misses("mm_malloc/mm_free", single_dtlb);
+	print_dtlb_misses("Arena", arena_dtlb);
+
+	return 0;
+}
@@ -0,0 +1,148 @@
+/**
+ * @file batch.c
+ *
+ * Microbenchmark for the batch allocation calls. Each thread
+ * repeatedly allocates and frees a batch of same-size objects, first
+ * with a loop of mm_malloc/mm_free calls and then with a single
+ * mm_malloc_batch/mm_free_batch pair, and the per-object cost of
+ * both is reported.
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "perf_counter.h"
+
+int nthreads = 1;	// Default number of threads.
+int niterations = 100000;	// Default number of iterations.
+int batch = 32;		// Default number of objects per batch.
+int size = 64;		// Default object size.
+int use_batch;		// Which pass the workers run.
+
+extern void * worker (void *arg)
+{
+	int i, j;
+#pragma GCC diagnostic ignored "-Wpointer-to-int-cast"
+	int cpu = (int)arg; // cpu number will fit in an int, ignore warning
+#pragma GCC diagnostic pop
+
+	setCPU(cpu);
+
+	void ** a = (void **)mm_malloc(batch * sizeof(void *));
+
+	for (j = 0; j < niterations; j++) {
+		if (use_batch) {
+			size_t n = mm_malloc_batch(size, batch, a);
+			assert (n == (size_t)batch);
+			(void)n;
+			mm_free_batch(a, batch);
+		} else {
+			for (i = 0; i < batch; i++) {
+				a[i] = mm_malloc(size);
+				assert (a[i]);
+			}
+			for (i = 0; i < batch; i++) {
+				mm_free(a[i]);
+			}
+		}
+	}
+
+	mm_free(a);
+
+	return NULL;
+}
+
+double run_pass (pthread_attr_t *attr, int numCPU, long long *dtlb_misses)
+{
+	struct timespec start_time;
+	struct timespec end_time;
+	int i;
+
+	pthread_t *threads = (pthread_t *)mm_malloc(nthreads*sizeof(pthread_t));
+
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
+
+	/* Get the starting time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], attr, &worker, (void *)((u_int64_t)(i+1)%numCPU));
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* Get the finish time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	*dtlb_misses = dtlb_counter_read(dtlb_fd);
+
+	mm_free(threads);
+
+	return timespec_diff(&start_time, &end_time);
+}
+
+void print_dtlb_misses (const char *pass, long long dtlb_misses)
+{
+	if (dtlb_misses >= 0) {
+		printf ("%s dTLB misses = %lld\n", pass, dtlb_misses);
+	} else {
+		printf ("%s dTLB misses = unavailable\n", pass);
+	}
+}
+
+int main (int argc, char * argv[])
+{
+	if (argc >= 2) {
+		nthreads = atoi(argv[1]);
+	}
+
+	if (argc >= 3) {
+		niterations = atoi(argv[2]);
+	}
+
+	if (argc >= 4) {
+		batch = atoi(argv[3]);
+	}
+
+	if (argc >= 5) {
+		size = atoi(argv[4]);
+	}
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	int numCPU = getNumProcessors();
+
+	pthread_attr_t attr;
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	printf ("Running batch for %d threads, %d iterations, %d objects per batch and %d size...\n", nthreads, niterations, batch, size);
+
+	/* Both passes count an allocation and a free per object */
+	double objects = (double)nthreads * niterations * batch;
+
+	long long single_dtlb, batched_dtlb;
+
+	use_batch = 0;
+	double single = run_pass(&attr, numCPU, &single_dtlb);
+	printf ("Single calls: %f seconds, %.2f ns per object\n", single, single * 1e9 / objects);
+
+	use_batch = 1;
+	double batched = run_pass(&attr, numCPU, &batched_dtlb);
+	printf ("Batch calls: %f seconds, %.2f ns per object\n", batched, batched * 1e9 / objects);
+
+	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	print_dtlb_misses("Single calls", single_dtlb);
+	print_dtlb_misses("Batch calls", batched_dtlb);
+
+	return 0;
+}
@@ -14,6 +14,7 @@
 #include "malloc.h"
 #include "memlib.h"
 #include "timer.h"
+#include "perf_counter.h"
 
 typedef void * LPVOID;
 typedef long long LONGLONG;
@@ -363,6 +364,9 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
 
       nperthread = chperthread ;
       stopflag   = FALSE ;
+
+      /* Count dTLB misses in the worker threads and their children */
+      int dtlb_fd = dtlb_counter_open();
 		
       for(i=0; i< num_threads; i++){
 	de_area[i].threadno    = i+1 ;
@@ -399,6 +403,7 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
 
       /* Get the ending time */
       clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+      long long dtlb_misses = dtlb_counter_read(dtlb_fd);
 
       sum_frees = sum_allocs =0  ;
       sum_threads = 0 ;
@@ -429,6 +434,12 @@ void runthreads(long sleep_cnt, int min_threads, int max_threads, int chperthrea
       
       printf ("Throughput = %8.0f operations per second.\n", sum_allocs / duration);
       printf ("Memory used = %ld bytes, required %.0lf, ratio %lf\n",used_space,reqd_space,used_space/reqd_space);
+      printf ("Resident set size = %ld bytes\n",mem_rss());
+      if (dtlb_misses >= 0) {
+	printf ("dTLB misses = %lld\n", dtlb_misses);
+      } else {
+	printf ("dTLB misses = unavailable\n");
+      }
 
 #if 0
       printf("%2d ", num_threads ) ;
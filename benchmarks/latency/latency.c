@@ -0,0 +1,425 @@
+/**
+ * @file latency.c
+ *
+ * Measures the latency of individual mm_malloc and mm_free calls. Each
+ * thread keeps a working set of live objects and repeatedly frees a
+ * random one and allocates a replacement whose size is drawn from a
+ * weighted mix of size classes. Every call is timed with rdtscp into a
+ * per-thread histogram for its size class and operation. After the run
+ * the histograms are merged, and p50, p99, p99.9 and the maximum are
+ * reported per size class, in nanoseconds.
+ *
+ * The histograms are HDR-style: buckets are linear within each power of
+ * two, with HISTOGRAM_SUB_BITS bits of resolution, so every value is
+ * reported within about 3% from a fixed number of buckets. They are
+ * mmap'd, so that they neither come from nor perturb the allocator under
+ * test. The size mix is a list of size:weight pairs with increasing
+ * sizes, where each class covers the sizes above the previous class up
+ * to its own size.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "perf_counter.h"
+
+#define MAX_CLASSES 16
+#define HISTOGRAM_SUB_BITS 5
+#define HISTOGRAM_HALF (1 << (HISTOGRAM_SUB_BITS - 1))
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 2) * HISTOGRAM_HALF)
+#define CALIBRATION_NS 50000000LL
+
+enum { OP_MALLOC = 0, OP_FREE, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = { "malloc", "free" };
+
+typedef struct histogram {
+	unsigned long long count;
+	unsigned long long max;
+	unsigned long long buckets[HISTOGRAM_BUCKETS];
+} histogram;
+
+typedef struct latency_thread {
+	histogram (*histograms)[NUM_OPS]; // [size class][op]
+	int cpu;
+	unsigned long long seed;
+} latency_thread;
+
+int nthreads = 1;		// Default number of threads.
+int niterations = 100000;	// Default number of iterations per thread.
+int nlive = 1000;		// Default number of live objects per thread.
+const char *mix = "16:8,64:8,256:4,1024:2,4096:1,32768:1,262144:1"; // Default size mix.
+
+int nclasses;
+size_t class_size[MAX_CLASSES];
+unsigned long long class_weight[MAX_CLASSES];
+unsigned long long total_weight;
+
+unsigned long long timer_overhead;
+double ticks_per_ns;
+
+static inline unsigned long long read_ticks (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	unsigned int aux;
+	unsigned long long ticks = __builtin_ia32_rdtscp(&aux);
+	/* keep the timed call from starting before the timer is read */
+	__builtin_ia32_lfence();
+	return ticks;
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/*
+ * Values below 2 * HISTOGRAM_HALF get a bucket each. Above that, values
+ * with magnitude m (v >> m in [HISTOGRAM_HALF, 2 * HISTOGRAM_HALF)) share
+ * buckets 2^m wide.
+ */
+static unsigned int histogram_index (unsigned long long value)
+{
+	if (value < 2 * HISTOGRAM_HALF) {
+		return value;
+	}
+	unsigned int magnitude = 63 - __builtin_clzll(value) - (HISTOGRAM_SUB_BITS - 1);
+	return magnitude * HISTOGRAM_HALF + (unsigned int)(value >> magnitude);
+}
+
+/* Largest value that lands in bucket index. */
+static unsigned long long histogram_value (unsigned int index)
+{
+	if (index < 2 * HISTOGRAM_HALF) {
+		return index;
+	}
+	unsigned int magnitude = index / HISTOGRAM_HALF - 1;
+	unsigned long long lowest = (unsigned long long)(index - magnitude * HISTOGRAM_HALF) << magnitude;
+	return lowest + (1ULL << magnitude) - 1;
+}
+
+static inline void histogram_record (histogram *h, unsigned long long value)
+{
+	h->buckets[histogram_index(value)]++;
+	h->count++;
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+static void histogram_merge (histogram *into, const histogram *from)
+{
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		into->buckets[i] += from->buckets[i];
+	}
+	into->count += from->count;
+	if (from->max > into->max) {
+		into->max = from->max;
+	}
+}
+
+static unsigned long long histogram_percentile (const histogram *h, double percentile)
+{
+	unsigned long long rank = (unsigned long long)(h->count * percentile / 100.0 + 0.5);
+	unsigned long long seen = 0;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (unsigned int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			unsigned long long value = histogram_value(i);
+			return (value < h->max) ? value : h->max;
+		}
+	}
+	return h->max;
+}
+
+static void *map_zeroed (size_t size)
+{
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return mem;
+}
+
+static int parse_mix (const char *spec)
+{
+	const char *next = spec;
+
+	while (*next != '\0') {
+		char *end;
+		unsigned long long size = strtoull(next, &end, 10);
+		unsigned long long weight = 1;
+
+		if (end == next || nclasses == MAX_CLASSES || size == 0 ||
+		    (nclasses > 0 && size <= class_size[nclasses - 1])) {
+			return -1;
+		}
+		if (*end == ':') {
+			next = end + 1;
+			weight = strtoull(next, &end, 10);
+			if (end == next) {
+				return -1;
+			}
+		}
+		class_size[nclasses] = size;
+		class_weight[nclasses] = weight;
+		total_weight += weight;
+		nclasses++;
+
+		if (*end == ',') {
+			end++;
+		} else if (*end != '\0') {
+			return -1;
+		}
+		next = end;
+	}
+
+	return (nclasses > 0 && total_weight > 0) ? 0 : -1;
+}
+
+/* Ticks taken by reading the timer back to back, subtracted from every call. */
+static unsigned long long measure_timer_overhead (void)
+{
+	unsigned long long best = ~0ULL;
+	for (int i = 0; i < 10000; i++) {
+		unsigned long long start = read_ticks();
+		unsigned long long ticks = read_ticks() - start;
+		if (ticks < best) {
+			best = ticks;
+		}
+	}
+	return best;
+}
+
+static double measure_ticks_per_ns (void)
+{
+	struct timespec start_time, now;
+	long long elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+	unsigned long long start = read_ticks();
+	do {
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		elapsed = (now.tv_sec - start_time.tv_sec) * 1000000000LL + now.tv_nsec - start_time.tv_nsec;
+	} while (elapsed < CALIBRATION_NS);
+	return (double)(read_ticks() - start) / elapsed;
+}
+
+static inline unsigned long long next_random (unsigned long long *state)
+{
+	unsigned long long x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static inline int pick_class (unsigned long long *state)
+{
+	unsigned long long r = next_random(state) % total_weight;
+	int c = 0;
+	while (r >= class_weight[c]) {
+		r -= class_weight[c];
+		c++;
+	}
+	return c;
+}
+
+static inline size_t pick_size (unsigned long long *state, int c)
+{
+	size_t lowest = (c == 0) ? 1 : class_size[c - 1] + 1;
+	return lowest + next_random(state) % (class_size[c] - lowest + 1);
+}
+
+static inline unsigned long long elapsed_ticks (unsigned long long start, unsigned long long end)
+{
+	unsigned long long ticks = end - start;
+	return (ticks > timer_overhead) ? ticks - timer_overhead : 0;
+}
+
+extern void * worker (void *arg)
+{
+	latency_thread *t = (latency_thread *)arg;
+	unsigned long long state = t->seed;
+	int i;
+
+	setCPU(t->cpu);
+
+	char **objects = (char **)map_zeroed(nlive * sizeof(char *));
+	int *classes = (int *)map_zeroed(nlive * sizeof(int));
+
+	/* Fill the working set without timing it */
+	for (i = 0; i < nlive; i++) {
+		classes[i] = pick_class(&state);
+		objects[i] = (char *)mm_malloc(pick_size(&state, classes[i]));
+		objects[i][0] = (char)i;
+	}
+
+	for (i = 0; i < niterations; i++) {
+		int slot = next_random(&state) % nlive;
+		int c = pick_class(&state);
+		size_t size = pick_size(&state, c);
+		unsigned long long start, end;
+
+		start = read_ticks();
+		mm_free(objects[slot]);
+		end = read_ticks();
+		histogram_record(&t->histograms[classes[slot]][OP_FREE], elapsed_ticks(start, end));
+
+		start = read_ticks();
+		char *object = (char *)mm_malloc(size);
+		end = read_ticks();
+		histogram_record(&t->histograms[c][OP_MALLOC], elapsed_ticks(start, end));
+
+		object[0] = (char)i;
+		objects[slot] = object;
+		classes[slot] = c;
+	}
+
+	for (i = 0; i < nlive; i++) {
+		mm_free(objects[i]);
+	}
+
+	munmap(objects, nlive * sizeof(char *));
+	munmap(classes, nlive * sizeof(int));
+
+	return NULL;
+}
+
+static void print_row (const char *label, const char *op, const histogram *h)
+{
+	if (h->count == 0) {
+		return;
+	}
+	printf ("%-16s %-7s %12llu %9.0f %9.0f %9.0f %12.0f\n", label, op, h->count,
+		histogram_percentile(h, 50.0) / ticks_per_ns,
+		histogram_percentile(h, 99.0) / ticks_per_ns,
+		histogram_percentile(h, 99.9) / ticks_per_ns,
+		h->max / ticks_per_ns);
+}
+
+int main (int argc, char * argv[])
+{
+	struct timespec start_time;
+	struct timespec end_time;
+	int i, c, op;
+
+	if (argc >= 2) {
+		nthreads = atoi(argv[1]);
+	}
+
+	if (argc >= 3) {
+		niterations = atoi(argv[2]);
+	}
+
+	if (argc >= 4) {
+		nlive = atoi(argv[3]);
+	}
+
+	if (argc >= 5) {
+		mix = argv[4];
+	}
+
+	if (nthreads < 1 || niterations < 0 || nlive < 1 || parse_mix(mix) != 0) {
+		fprintf (stderr, "Usage: %s [nthreads] [iterations] [live objects] [size:weight,...]\n", argv[0]);
+		return 1;
+	}
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	int numCPU = getNumProcessors();
+
+	timer_overhead = measure_timer_overhead();
+	ticks_per_ns = measure_ticks_per_ns();
+
+	pthread_t threads[nthreads];
+	latency_thread *args = (latency_thread *)map_zeroed(nthreads * sizeof(latency_thread));
+
+	pthread_attr_t attr;
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	printf ("Running latency for %d threads, %d iterations, %d live objects per thread and size mix %s...\n",
+		nthreads, niterations, nlive, mix);
+	printf ("Timer: %.3f ticks per ns, %llu ticks of overhead subtracted per call\n",
+		ticks_per_ns, timer_overhead);
+
+	for (i = 0; i < nthreads; i++) {
+		args[i].histograms = map_zeroed(MAX_CLASSES * sizeof(*args[i].histograms));
+		args[i].cpu = (i+1)%numCPU;
+		args[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+	}
+
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
+
+	/* Get the starting time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_create(&threads[i], &attr, &worker, (void *)&args[i]);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* Get the finish time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	long long dtlb_misses = dtlb_counter_read(dtlb_fd);
+
+	double t = timespec_diff(&start_time, &end_time);
+
+	/* Merge the threads' histograms into the first thread's */
+	histogram (*merged)[NUM_OPS] = args[0].histograms;
+	for (i = 1; i < nthreads; i++) {
+		for (c = 0; c < nclasses; c++) {
+			for (op = 0; op < NUM_OPS; op++) {
+				histogram_merge(&merged[c][op], &args[i].histograms[c][op]);
+			}
+		}
+	}
+
+	histogram *all = (histogram *)map_zeroed(NUM_OPS * sizeof(histogram));
+	printf ("%-16s %-7s %12s %9s %9s %9s %12s\n", "size class", "op", "calls",
+		"p50 ns", "p99 ns", "p99.9 ns", "max ns");
+	for (c = 0; c < nclasses; c++) {
+		char label[32];
+		snprintf(label, sizeof(label), "%zu-%zu", (c == 0) ? 1 : class_size[c - 1] + 1, class_size[c]);
+		for (op = 0; op < NUM_OPS; op++) {
+			print_row(label, op_names[op], &merged[c][op]);
+			histogram_merge(&all[op], &merged[c][op]);
+		}
+	}
+	for (op = 0; op < NUM_OPS; op++) {
+		print_row("all", op_names[op], &all[op]);
+	}
+
+	printf ("Time elapsed = %f seconds\n", t);
+	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	mm_trim();
+	printf ("Resident set size after mm_trim = %ld bytes\n",mem_rss());
+	if (dtlb_misses >= 0) {
+		printf ("dTLB misses = %lld\n", dtlb_misses);
+	} else {
+		printf ("dTLB misses = unavailable\n");
+	}
+
+	return 0;
+}
@@ -28,6 +28,7 @@
 
 #include "mm_thread.h"
 #include "timer.h"
+#include "perf_counter.h"
 #include "malloc.h"
 #include "memlib.h"
 
@@ -97,6 +98,9 @@ main (int argc, char *argv[])
 				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
 
 	printf ("Starting test...\n");
+
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
 	
 	for (i = 0; i < thread_count; i++) {
 		int * tid = (int *) mm_malloc(sizeof(int));
@@ -119,6 +123,7 @@ main (int argc, char *argv[])
 			exit(1);
 		}
 	}
+	long long dtlb_misses = dtlb_counter_read(dtlb_fd);
 	
 	/* EDB: moved to outer loop. */
 	/* Statistics gathering and reporting. */
@@ -141,6 +146,14 @@ main (int argc, char *argv[])
 	}
 	
 	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	mm_trim();
+	printf ("Resident set size after mm_trim = %ld bytes\n",mem_rss());
+	if (dtlb_misses >= 0) {
+		printf ("dTLB misses = %lld\n", dtlb_misses);
+	} else {
+		printf ("dTLB misses = unavailable\n");
+	}
 	mm_free(executionTimes);
 	
 	exit (0);
@@ -12,6 +12,7 @@
 
 #include "mm_thread.h"
 #include "timer.h"
+#include "perf_counter.h"
 #include "malloc.h"
 #include "memlib.h"
 
@@ -175,6 +176,9 @@ int main(int argc, char* argv[])
 	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
 				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
 
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
+
 	/* Get the starting time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
 	
@@ -190,10 +194,19 @@ int main(int argc, char* argv[])
 
 	/* Get the finish time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	long long dtlb_misses = dtlb_counter_read(dtlb_fd);
 	elapsed = timespec_diff(&start_time, &end_time);
 
 	printf ("Time elapsed = %f seconds\n", elapsed);
 	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	mm_trim();
+	printf ("Resident set size after mm_trim = %ld bytes\n",mem_rss());
+	if (dtlb_misses >= 0) {
+		printf ("dTLB misses = %lld\n", dtlb_misses);
+	} else {
+		printf ("dTLB misses = unavailable\n");
+	}
 
 	
 	return 0;
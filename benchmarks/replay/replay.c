@@ -0,0 +1,403 @@
+/**
+ * @file replay.c
+ *
+ * Replays an allocation trace recorded with A3ALLOC_RECORD (see
+ * mm_record.h) against one of the allocators. Each recorded thread gets
+ * a thread of its own. In the default interleaved mode every call waits
+ * for all calls recorded before it, which reproduces the recorded
+ * interleaving exactly. In fast mode a call only waits for the earlier
+ * calls on its object (and on the object that held its slot before),
+ * so threads run as fast as the trace allows.
+ *
+ * The trace and the bookkeeping live in mmap'd memory, so the allocator
+ * under test only sees the replayed calls. Allocations are touched one
+ * byte per page, the way the recorded program would have used them.
+ * A sampling thread tracks the peak of mem_usage() and of the RSS.
+ *
+ * Interleaved threads hand over to each other through a futex each, as
+ * most calls switch threads and the switches would otherwise dominate
+ * the time on machines with fewer CPUs than recorded threads.
+ */
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "mm_thread.h"
+#include "timer.h"
+#include "malloc.h"
+#include "memlib.h"
+#include "mm_record.h"
+#include "perf_counter.h"
+
+#define SAMPLE_INTERVAL_US 1000
+#define SPINS 64
+#define TOUCH_STRIDE 4096
+#define NO_SLOT 0xffffffffu
+
+typedef struct replay_event {
+	unsigned long long index; // position among all replayed calls
+	unsigned long long size;
+	unsigned int slot;        // where the object's pointer is kept
+	unsigned int turn;        // calls on the slot before this one
+	unsigned int op;
+	int next_thread;          // thread of the next call, -1 after the last
+} replay_event;
+
+typedef struct replay_slot {
+	void *ptr;
+	unsigned int done;        // calls on the slot that have completed
+} replay_slot;
+
+typedef struct replay_thread {
+	replay_event *events;
+	unsigned long long count;
+	int index;
+	int cpu;
+	unsigned int wakeups;     // futex the thread sleeps on in interleaved mode
+} replay_thread;
+
+int fast;                     // replay as fast as possible rather than interleaved
+replay_thread *threads;
+replay_slot *slots;
+unsigned long long position;  // replayed calls so far, in interleaved mode
+unsigned long long failed;    // allocations that returned NULL
+
+volatile int sampling;
+long peak_usage;
+long peak_rss;
+
+static void *map_zeroed (size_t size)
+{
+	void *mem = mmap(NULL, size ? size : 1, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (mem == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	return mem;
+}
+
+static void wait_for (unsigned int *counter, unsigned int value)
+{
+	int spins = 0;
+	while (__atomic_load_n(counter, __ATOMIC_ACQUIRE) != value) {
+		if (++spins > SPINS) {
+			sched_yield();
+		}
+	}
+}
+
+/* Sleeps until the call at index is the next one to replay. */
+static void wait_for_position (replay_thread *t, unsigned long long index)
+{
+	int spins = 0;
+	while (__atomic_load_n(&position, __ATOMIC_ACQUIRE) != index) {
+		unsigned int seen = __atomic_load_n(&t->wakeups, __ATOMIC_ACQUIRE);
+		if (++spins < SPINS || __atomic_load_n(&position, __ATOMIC_ACQUIRE) == index) {
+			continue;
+		}
+		syscall(SYS_futex, &t->wakeups, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+	}
+}
+
+/* Passes the turn to the thread of the call after index. */
+static void advance_position (replay_thread *t, replay_event *e)
+{
+	__atomic_store_n(&position, e->index + 1, __ATOMIC_SEQ_CST);
+	if (e->next_thread >= 0 && e->next_thread != t->index) {
+		replay_thread *next = &threads[e->next_thread];
+		__atomic_fetch_add(&next->wakeups, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, &next->wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+
+static void touch (char *mem, unsigned long long size)
+{
+	for (unsigned long long offset = 0; offset < size; offset += TOUCH_STRIDE) {
+		mem[offset] = (char)offset;
+	}
+}
+
+static void sample (void)
+{
+	long usage = mem_usage();
+	long rss = mem_rss();
+
+	if (usage > peak_usage) {
+		peak_usage = usage;
+	}
+	if (rss > peak_rss) {
+		peak_rss = rss;
+	}
+}
+
+extern void * sampler (void *arg)
+{
+	(void)arg;
+	while (sampling) {
+		sample();
+		usleep(SAMPLE_INTERVAL_US);
+	}
+	return NULL;
+}
+
+extern void * worker (void *arg)
+{
+	replay_thread *t = (replay_thread *)arg;
+
+	setCPU(t->cpu);
+
+	for (unsigned long long i = 0; i < t->count; i++) {
+		replay_event *e = &t->events[i];
+		replay_slot *s = &slots[e->slot];
+
+		if (fast) {
+			wait_for(&s->done, e->turn);
+		} else {
+			wait_for_position(t, e->index);
+		}
+
+		switch (e->op) {
+		case MM_RECORD_MALLOC:
+			s->ptr = mm_malloc(e->size);
+			break;
+		case MM_RECORD_CALLOC:
+			s->ptr = mm_calloc(1, e->size);
+			break;
+		case MM_RECORD_REALLOC:
+			s->ptr = mm_realloc(s->ptr, e->size);
+			break;
+		case MM_RECORD_FREE:
+			mm_free(s->ptr);
+			s->ptr = NULL;
+			break;
+		}
+
+		if (e->op != MM_RECORD_FREE) {
+			if (s->ptr != NULL) {
+				touch((char *)s->ptr, e->size);
+			} else if (e->size != 0) {
+				__atomic_fetch_add(&failed, 1, __ATOMIC_RELAXED);
+			}
+		}
+
+		if (fast) {
+			__atomic_store_n(&s->done, e->turn + 1, __ATOMIC_RELEASE);
+		} else {
+			advance_position(t, e);
+		}
+	}
+
+	return NULL;
+}
+
+/* Maps the trace file and checks its header, returns the events. */
+static mm_record_event_t *load_trace (const char *path, unsigned long long *count)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(1);
+	}
+
+	mm_record_header_t *header = NULL;
+	if ((size_t)st.st_size >= sizeof(mm_record_header_t)) {
+		header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	close(fd);
+	if (header == NULL || header == MAP_FAILED ||
+	    memcmp(header->magic, MM_RECORD_MAGIC, sizeof(header->magic)) != 0 ||
+	    header->event_size != sizeof(mm_record_event_t)) {
+		fprintf(stderr, "%s: not an allocation trace\n", path);
+		exit(1);
+	}
+
+	*count = (st.st_size - sizeof(mm_record_header_t)) / sizeof(mm_record_event_t);
+	return (mm_record_event_t *)(header + 1);
+}
+
+/*
+ * Puts the calls in seq order, drops those on objects the trace lost
+ * track of and assigns each object a slot, reusing the slots of freed
+ * objects. Returns the calls of each recorded thread in order.
+ */
+static replay_thread *prepare (mm_record_event_t *trace, unsigned long long count,
+			       int *nthreads, unsigned long long *nevents, unsigned int *nslots)
+{
+	unsigned long long max_seq = 0;
+	for (unsigned long long i = 0; i < count; i++) {
+		if (trace[i].seq > max_seq) {
+			max_seq = trace[i].seq;
+		}
+	}
+
+	/* seqs are dense, so ordering them is a matter of placing them */
+	mm_record_event_t **ordered = map_zeroed((max_seq + 1) * sizeof(mm_record_event_t *));
+	for (unsigned long long i = 0; i < count; i++) {
+		ordered[trace[i].seq] = &trace[i];
+	}
+
+	/* objects are numbered by seq as well */
+	unsigned int *slot_of = map_zeroed((max_seq + 1) * sizeof(unsigned int));
+	memset(slot_of, 0xff, (max_seq + 1) * sizeof(unsigned int));
+	unsigned int *turns = map_zeroed((count + 1) * sizeof(unsigned int));
+	unsigned int *free_slots = map_zeroed((count + 1) * sizeof(unsigned int));
+	unsigned int nfree = 0;
+
+	replay_event *events = map_zeroed((count + 1) * sizeof(replay_event));
+	const mm_record_event_t **sources = map_zeroed((count + 1) * sizeof(mm_record_event_t *));
+	unsigned long long per_thread[1 << 14] = { 0 };
+	unsigned long long n = 0;
+
+	*nslots = 0;
+	for (unsigned long long seq = 0; seq <= max_seq; seq++) {
+		const mm_record_event_t *r = ordered[seq];
+		if (r == NULL || r->object > max_seq) {
+			continue;
+		}
+
+		unsigned int slot = slot_of[r->object];
+		if (r->op == MM_RECORD_MALLOC || r->op == MM_RECORD_CALLOC) {
+			slot = nfree ? free_slots[--nfree] : (*nslots)++;
+			slot_of[r->object] = slot;
+		} else if (slot == NO_SLOT) {
+			continue;
+		} else if (r->op == MM_RECORD_FREE) {
+			slot_of[r->object] = NO_SLOT;
+			free_slots[nfree++] = slot;
+		}
+
+		events[n].index = n;
+		events[n].size = r->size;
+		events[n].slot = slot;
+		events[n].turn = turns[slot]++;
+		events[n].op = r->op;
+		events[n].next_thread = -1;
+		if (n > 0) {
+			events[n - 1].next_thread = r->thread;
+		}
+		sources[n] = r;
+		per_thread[r->thread]++;
+		n++;
+	}
+
+	*nthreads = 0;
+	for (int i = 0; i < (1 << 14); i++) {
+		if (per_thread[i] != 0) {
+			*nthreads = i + 1;
+		}
+	}
+
+	replay_thread *replayers = map_zeroed((*nthreads + 1) * sizeof(replay_thread));
+	replay_event *split = map_zeroed((n + 1) * sizeof(replay_event));
+	unsigned long long offset = 0;
+	for (int i = 0; i < *nthreads; i++) {
+		replayers[i].events = split + offset;
+		replayers[i].index = i;
+		offset += per_thread[i];
+	}
+	for (unsigned long long i = 0; i < n; i++) {
+		replay_thread *t = &replayers[sources[i]->thread];
+		t->events[t->count++] = events[i];
+	}
+
+	munmap(ordered, (max_seq + 1) * sizeof(mm_record_event_t *));
+	munmap(slot_of, (max_seq + 1) * sizeof(unsigned int));
+	munmap(turns, (count + 1) * sizeof(unsigned int));
+	munmap(free_slots, (count + 1) * sizeof(unsigned int));
+	munmap(events, (count + 1) * sizeof(replay_event));
+	munmap(sources, (count + 1) * sizeof(mm_record_event_t *));
+
+	*nevents = n;
+	return replayers;
+}
+
+int main (int argc, char * argv[])
+{
+	unsigned long long count, nevents;
+	unsigned int nslots;
+	int nthreads;
+	int i;
+	struct timespec start_time;
+	struct timespec end_time;
+
+	if (argc < 2 || (argc >= 3 && strcmp(argv[2], "fast") != 0 && strcmp(argv[2], "interleaved") != 0)) {
+		fprintf (stderr, "Usage: %s trace [interleaved|fast]\n", argv[0]);
+		return 1;
+	}
+	fast = (argc >= 3 && strcmp(argv[2], "fast") == 0);
+
+	mm_record_event_t *trace = load_trace(argv[1], &count);
+	threads = prepare(trace, count, &nthreads, &nevents, &nslots);
+	slots = map_zeroed((nslots + 1) * sizeof(replay_slot));
+
+	/* Call allocator-specific initialization function */
+	mm_init();
+
+	int numCPU = getNumProcessors();
+	pthread_t workers[nthreads + 1];
+	pthread_t sampler_thread;
+
+	pthread_attr_t attr;
+	initialize_pthread_attr(PTHREAD_CREATE_JOINABLE, SCHED_RR, -10,
+				PTHREAD_EXPLICIT_SCHED, PTHREAD_SCOPE_SYSTEM, &attr);
+
+	printf ("Replaying %s: %llu calls on %u slots by %d threads, %s...\n",
+		argv[1], nevents, nslots, nthreads, fast ? "fast" : "interleaved");
+
+	long trace_rss = mem_rss();
+	sampling = 1;
+	pthread_create(&sampler_thread, NULL, &sampler, NULL);
+
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
+
+	/* Get the starting time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
+
+	for (i = 0; i < nthreads; i++) {
+		threads[i].cpu = (i+1)%numCPU;
+		pthread_create(&workers[i], &attr, &worker, (void *)&threads[i]);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	/* Get the finish time */
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	long long dtlb_misses = dtlb_counter_read(dtlb_fd);
+
+	sampling = 0;
+	pthread_join(sampler_thread, NULL);
+	sample();
+
+	double t = timespec_diff(&start_time, &end_time);
+
+	printf ("Time elapsed = %f seconds\n", t);
+	if (failed != 0) {
+		printf ("Failed allocations = %llu\n", failed);
+	}
+	printf ("Peak memory used = %ld bytes\n", peak_usage);
+	printf ("Peak resident set size = %ld bytes (%ld bytes before the replay)\n", peak_rss, trace_rss);
+	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	mm_trim();
+	printf ("Resident set size after mm_trim = %ld bytes\n",mem_rss());
+	if (dtlb_misses >= 0) {
+		printf ("dTLB misses = %lld\n", dtlb_misses);
+	} else {
+		printf ("dTLB misses = unavailable\n");
+	}
+
+	return 0;
+}
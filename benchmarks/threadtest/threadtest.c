@@ -37,6 +37,7 @@
 
 #include "mm_thread.h"
 #include "timer.h"
+#include "perf_counter.h"
 #include "malloc.h"
 #include "memlib.h"
 
@@ -138,6 +139,9 @@ int main (int argc, char * argv[])
 
 	printf ("Running threadtest for %d threads, %d iterations, %d objects, %d work and %d size...\n", nthreads, niterations, nobjects, work, size);
 
+	/* Count dTLB misses in the worker threads */
+	int dtlb_fd = dtlb_counter_open();
+
 	/* Get the starting time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &start_time);
 
@@ -151,11 +155,20 @@ int main (int argc, char * argv[])
 
 	/* Get the finish time */
 	clock_gettime(CLOCK_MONOTONIC_RAW, &end_time);
+	long long dtlb_misses = dtlb_counter_read(dtlb_fd);
 
 	double t = timespec_diff(&start_time, &end_time);
 
 	printf ("Time elapsed = %f seconds\n", t);
 	printf ("Memory used = %ld bytes\n",mem_usage());
+	printf ("Resident set size = %ld bytes\n",mem_rss());
+	mm_trim();
+	printf ("Resident set size after mm_trim = %ld bytes\n",mem_rss());
+	if (dtlb_misses >= 0) {
+		printf ("dTLB misses = %lld\n", dtlb_misses);
+	} else {
+		printf ("dTLB misses = unavailable\n");
+	}
 	
 	mm_free(threads);
 
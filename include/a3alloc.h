@@ -0,0 +1,187 @@
+#ifndef __A3ALLOC_H_
+#define __A3ALLOC_H_
+
+/*
+ * Extensions specific to the a3alloc allocator, on top of the
+ * common interface in malloc.h.
+ */
+
+#include "malloc.h"
+
+/* Number of small blocks freed by a thread running on a processor other
+ * than the one whose heap owns them (handed over through the owner's
+ * lock-free remote free list). */
+extern unsigned long long mm_remote_free_count (void);
+
+/* Allocates size bytes aligned to alignment, which must be a power of
+ * two.  The block must be freed with mm_free rather than mm_free_sized. */
+extern void *mm_memalign (size_t alignment, size_t size);
+
+/* Isolated heaps.  An mm_heap has its own per-processor sub-heaps, so
+ * its blocks never share superblocks or pages with those of other heaps.
+ * Its blocks are freed with mm_free (or reallocated with mm_realloc) like
+ * any other, and mm_heap_destroy releases all of its memory at once,
+ * after which none of its blocks may be used. */
+typedef struct mm_heap mm_heap;
+
+extern mm_heap *mm_heap_create (void);
+extern void *mm_heap_malloc (mm_heap *heap, size_t size);
+extern void mm_heap_destroy (mm_heap *heap);
+
+/* Statistics.  a3alloc has MM_STATS_CLASSES size classes, the small
+ * ones up to 4096 bytes and the medium ones up to 256 KB; larger blocks
+ * are whole pages.  mm_stats fills in a snapshot of one of the default
+ * heaps, 0 to mm_stats_num_heaps () - 2 for the processor heaps and the
+ * last one for the global heap, and returns -1 for any other index.
+ * Blocks sitting in the thread caches count as used, since the heap
+ * handed them out.  The counters are kept per heap under its lock, so
+ * they cost nothing extra on the allocation paths, and they count the
+ * blocks that refill and flush the caches rather than calls.
+ * mm_heap_stats does the same for the sub-heaps and global heap of an
+ * isolated heap, whose blocks bypass the caches. */
+#define MM_STATS_CLASSES 52
+
+typedef struct
+{
+  size_t block_size;
+  size_t superblocks;
+  size_t used_blocks;           /* handed out, including cached blocks */
+  size_t used_bytes;
+  size_t free_blocks;           /* free blocks in the superblocks */
+  unsigned long long refilled;  /* blocks the heap handed out */
+  unsigned long long flushed;   /* blocks returned to the heap */
+} mm_class_stats_t;
+
+typedef struct
+{
+  size_t held_bytes;            /* blocks of every size in the heap's superblocks */
+  size_t in_use_bytes;          /* of which handed out */
+  size_t reserve_bytes;         /* fresh pages left to carve from */
+  size_t free_runs;             /* runs of free pages */
+  size_t free_run_bytes;
+  mm_class_stats_t classes[MM_STATS_CLASSES];
+} mm_heap_stats_t;
+
+extern unsigned int mm_stats_num_heaps (void);
+extern int mm_stats (unsigned int heap, mm_heap_stats_t *stats);
+extern int mm_heap_stats (mm_heap *heap, unsigned int index,
+                          mm_heap_stats_t *stats);
+
+/* Calls on the default heaps, summed over every thread.  Each thread
+ * counts its own calls per size class, and a thread's counts are added
+ * to a total when it exits.  Live blocks are the allocations not freed
+ * yet, so blocks in the thread and processor caches are not live.
+ * Large blocks are those above 256 KB, and those the heap profile
+ * samples; their bytes are whole pages.  Blocks of isolated heaps,
+ * arenas and object caches are not counted.  The counts of other
+ * threads are read while they run, so they can lag a little. */
+typedef struct
+{
+  size_t block_size;
+  unsigned long long allocs;
+  unsigned long long frees;
+  size_t live_blocks;
+  size_t live_bytes;
+  size_t cached_blocks;         /* in the thread and processor caches */
+} mm_class_calls_t;
+
+typedef struct
+{
+  mm_class_calls_t classes[MM_STATS_CLASSES];
+  unsigned long long large_allocs;
+  unsigned long long large_frees;
+  size_t large_blocks;          /* live large blocks */
+  size_t large_bytes;
+} mm_call_stats_t;
+
+extern void mm_call_stats (mm_call_stats_t *stats);
+
+/* Prints every non-empty size class of every default heap to stderr,
+ * followed by the blowup: the bytes the processor heaps and the global
+ * heap hold in superblocks against the bytes handed out of them, and by
+ * the calls of every class and the large blocks.  Also runs at exit when
+ * A3ALLOC_STATS_REPORT is set. */
+extern void mm_stats_print (void);
+
+/* Slow call tracing.  While A3ALLOC_TRACE_SLOW_NS is set, each call to
+ * mm_malloc, mm_free or mm_free_sized that takes at least that many
+ * nanoseconds leaves an event in a lock-free ring buffer of the calling
+ * thread, with the time the call spent in each of the allocator's slow
+ * phases.  mm_trace_drain moves the events of every thread out of their
+ * rings, events recorded while a ring is full are dropped and counted
+ * by mm_trace_dropped. */
+enum
+{
+  MM_TRACE_MALLOC = 0,
+  MM_TRACE_FREE
+};
+
+enum
+{
+  MM_TRACE_LOCK_WAIT = 0,       /* waiting on contended locks */
+  MM_TRACE_REMOTE_DRAIN,        /* taking back blocks other threads freed */
+  MM_TRACE_PAGE_SEARCH,         /* looking for a free page run to reuse */
+  MM_TRACE_PAGE_FREE,           /* coalescing and binning freed pages */
+  MM_TRACE_SBRK,                /* growing the heap with mem_sbrk */
+  MM_TRACE_PURGE,               /* giving free pages back to the OS */
+  MM_TRACE_PHASES
+};
+
+typedef struct
+{
+  unsigned long long timestamp_ns;      /* since tracing started */
+  unsigned int thread;          /* kernel thread id */
+  unsigned char op;             /* MM_TRACE_MALLOC or MM_TRACE_FREE */
+  unsigned char grew;           /* took fresh memory from mem_sbrk */
+  unsigned short walk_length;   /* free page runs and remote frees visited */
+  size_t size;                  /* requested or freed block size */
+  unsigned int total_ns;
+  unsigned int phase_ns[MM_TRACE_PHASES];
+} mm_trace_event_t;
+
+extern size_t mm_trace_drain (mm_trace_event_t *events, size_t max);
+extern unsigned long long mm_trace_dropped (void);
+
+/* Drains every event to stderr.  Also runs at exit while tracing. */
+extern void mm_trace_print (void);
+
+/* Writes a heap profile in the text format pprof reads: the sampled
+ * blocks still live and ever allocated, by call stack, followed by the
+ * process's mappings.  Only sampled allocations made through mm_malloc,
+ * mm_calloc and mm_realloc are profiled.  Returns -1 when profiling is
+ * off (see A3ALLOC_HEAP_PROFILE in the README) or path cannot be
+ * written. */
+extern int mm_heap_profile_dump (const char *path);
+
+/* Typed object caches.  An mm_cache hands out objects of one size from
+ * slabs packed with nothing else, keeping freed objects constructed:
+ * ctor runs once per object when its slab is created and dtor once when
+ * the slab is destroyed, so objects must be freed in their constructed
+ * state.  Either may be NULL.  Each processor caches a magazine of
+ * objects in front of the slabs, which mm_trim returns to them. */
+typedef struct mm_cache mm_cache;
+
+typedef struct
+{
+  const char *name;
+  size_t object_size;           /* size rounded up to the alignment */
+  size_t slab_size;
+  size_t slab_objects;          /* objects per slab */
+  unsigned long long allocs;
+  unsigned long long frees;
+  unsigned long long slabs_created;
+  unsigned long long slabs_destroyed;
+  size_t slabs;                 /* slabs currently held */
+  size_t cached_objects;        /* objects in the processors' magazines */
+} mm_cache_stats_t;
+
+extern mm_cache *mm_cache_create (const char *name, size_t size,
+                                  size_t alignment,
+                                  void (*ctor) (void *),
+                                  void (*dtor) (void *));
+extern void *mm_cache_alloc (mm_cache *cache);
+extern void mm_cache_free (mm_cache *cache, void *object);
+extern void mm_cache_stats (mm_cache *cache, mm_cache_stats_t *stats);
+extern void mm_cache_destroy (mm_cache *cache);
+
+#endif /* __A3ALLOC_H_ */
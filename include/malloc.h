@@ -8,6 +8,27 @@
 extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
+extern void *mm_calloc (size_t nmemb, size_t size);
+extern void *mm_realloc (void *ptr, size_t size);
+extern size_t mm_usable_size (void *ptr);
+/* SIZE must map to the same size class as the size PTR was allocated
+ * with, e.g. the size passed to mm_malloc or anything up to its
+ * mm_usable_size, since the class is not looked up again.  Blocks from
+ * mm_memalign or an arena must not be freed this way. */
+extern void mm_free_sized (void *ptr, size_t size);
+extern size_t mm_malloc_batch (size_t size, size_t n, void **out);
+extern void mm_free_batch (void **ptrs, size_t n);
+extern void mm_trim (void);
+
+/* Arenas hand out objects that are all freed together by mm_arena_reset
+ * or mm_arena_destroy, never by mm_free.  An arena must only be used by
+ * one thread at a time, so threads sharing work each create their own. */
+typedef struct mm_arena mm_arena;
+
+extern mm_arena *mm_arena_create (void);
+extern void *mm_arena_alloc (mm_arena *arena, size_t size);
+extern void mm_arena_reset (mm_arena *arena);
+extern void mm_arena_destroy (mm_arena *arena);
 
 /* Team information */
 typedef struct {
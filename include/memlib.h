@@ -12,15 +12,20 @@
 #include <stddef.h>
 
 
-#define DSEG_MAX 256*1024*1024  /* 256 Mb */
+#define DSEG_MAX (256L*1024*1024*1024)  /* 256 Gb of address space reserved for the heap */
+#define DSEG_MIN (256L*1024*1024)       /* smallest reservation mem_init falls back to */
 
 extern char *dseg_lo, *dseg_hi;
 extern long dseg_size;
 
 extern int mem_init (void);
 extern void *mem_sbrk (ptrdiff_t increment);
+extern void *mem_sbrk_aligned (ptrdiff_t increment, size_t alignment);
 extern int mem_pagesize (void);
+extern size_t mem_hugepage_size (void);
 extern ptrdiff_t mem_usage (void);
+extern int mem_release (void *ptr, size_t len, int advice);
+extern long mem_rss (void);
 
 #endif /* __MEMLIB_H_ */
 
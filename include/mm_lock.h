@@ -0,0 +1,75 @@
+#ifndef _MM_LOCK_H_
+#define _MM_LOCK_H_
+
+#include <pthread.h>
+
+// Profiling mutex for the allocators. Each acquisition is counted
+// under the code path that took the lock, along with whether it had to
+// wait. Wait times (of contended acquisitions) and hold times (of one
+// in MM_LOCK_HOLD_SAMPLING acquisitions per path) go into log2
+// histograms of timer ticks, TSC cycles on x86 and nanoseconds
+// elsewhere. The statistics are only written while the lock is held,
+// so they need no atomics, and most uncontended acquisitions cost a
+// trylock and a few increments.
+//
+// Locks named with mm_lock_init are registered for mm_lock_report,
+// which prints every lock that has been taken to stderr. It also runs
+// at exit when the MM_LOCK_PROFILE environment variable is set.
+
+enum mm_lock_path {
+	MM_LOCK_SMALL_ALLOC = 0,
+	MM_LOCK_SMALL_FREE,
+	MM_LOCK_LARGE_ALLOC,
+	MM_LOCK_LARGE_FREE,
+	MM_LOCK_SBRK,        // taking fresh or recycled pages for a heap
+	MM_LOCK_MAINTENANCE, // trimming, purging, statistics, fork, registries
+	MM_LOCK_NUM_PATHS
+};
+
+#define MM_LOCK_HOLD_SAMPLING 16 // power of two
+#define MM_LOCK_HISTOGRAM_BUCKETS 32
+#define MM_LOCK_NAME_LENGTH 32
+
+typedef struct mm_lock {
+	pthread_mutex_t mutex;
+	unsigned long long acquired_at; // tick the holder got the lock at, 0 if not sampled
+	enum mm_lock_path path;         // path of the holder
+
+	unsigned long long acquisitions[MM_LOCK_NUM_PATHS];
+	unsigned long long contended[MM_LOCK_NUM_PATHS];
+	unsigned long long wait_ticks[MM_LOCK_NUM_PATHS];
+	unsigned long long hold_samples[MM_LOCK_NUM_PATHS];
+	unsigned long long hold_ticks[MM_LOCK_NUM_PATHS];
+	unsigned long long wait_histogram[MM_LOCK_HISTOGRAM_BUCKETS];
+	unsigned long long hold_histogram[MM_LOCK_HISTOGRAM_BUCKETS];
+
+	char name[MM_LOCK_NAME_LENGTH];
+	struct mm_lock *prev;
+	struct mm_lock *next;
+	int registered;
+} mm_lock_t;
+
+// Usable before mm_lock_init, but such a lock is not reported.
+#define MM_LOCK_INITIALIZER { PTHREAD_MUTEX_INITIALIZER }
+
+// Initializes a lock and registers it under name, which is copied.
+// mm_lock_destroy unregisters it again.
+extern void mm_lock_init(mm_lock_t *lock, const char *name);
+extern void mm_lock_destroy(mm_lock_t *lock);
+
+extern void mm_lock_acquire(mm_lock_t *lock, enum mm_lock_path path);
+extern void mm_lock_release(mm_lock_t *lock);
+
+// Counters of locks other threads hold may be read mid-update.
+extern void mm_lock_report(void);
+
+// The timer the locks count in, for callers that time their own work
+// in the same ticks.
+extern unsigned long long mm_lock_ticks(void);
+
+// Ticks the calling thread has spent waiting on contended locks so
+// far, so that callers can tell how much of an operation went to lock
+// waits. Only updated on contended acquisitions.
+extern __thread unsigned long long mm_lock_thread_wait_ticks;
+
+#endif /* _MM_LOCK_H_ */
@@ -0,0 +1,64 @@
+#ifndef _MM_RECORD_H_
+#define _MM_RECORD_H_
+
+#include <stddef.h>
+
+// Allocation trace recorder. Once mm_record_start has opened a trace
+// file, the hooks below log every allocation call into a buffer of the
+// calling thread, which is appended to the file whenever it fills up,
+// when the thread exits and at mm_record_stop (which also runs at exit).
+// benchmarks/replay plays a trace back against any of the allocators.
+//
+// A trace file is an mm_record_header_t followed by events, which are
+// only ordered by seq within each thread. Objects are numbered by the
+// seq of the call that allocated them and keep their number across
+// reallocations; recording keeps a table from addresses to numbers to
+// tell which object a free or realloc is about.
+
+#define MM_RECORD_MAGIC "MMTRACE1"
+
+enum mm_record_op {
+	MM_RECORD_MALLOC = 0,
+	MM_RECORD_CALLOC,
+	MM_RECORD_REALLOC,
+	MM_RECORD_FREE
+};
+
+typedef struct mm_record_header {
+	char magic[8];
+	unsigned int event_size; // sizeof(mm_record_event_t)
+	unsigned int reserved;
+} mm_record_header_t;
+
+typedef struct mm_record_event {
+	unsigned long long seq;          // position of the call among all recorded calls
+	unsigned long long timestamp;    // nanoseconds since recording started
+	unsigned long long object;       // seq of the call that allocated the object
+	unsigned long long size : 48;    // requested size, 0 for frees
+	unsigned long long thread : 14;  // numbered from 0, reused once a thread exits
+	unsigned long long op : 2;       // enum mm_record_op
+} mm_record_event_t;
+
+// Set while a trace is being recorded, so that callers only pay for a
+// load while it is not.
+extern int mm_recording;
+
+// Returns -1 when the file cannot be created. The hooks never allocate
+// through malloc, so they are safe to call from inside an allocator.
+extern int mm_record_start(const char *path);
+extern void mm_record_stop(void);
+
+// Call after an allocation returned ptr (MM_RECORD_MALLOC or
+// MM_RECORD_CALLOC).
+extern void mm_record_alloc(enum mm_record_op op, void *ptr, size_t size);
+
+// Call before ptr is freed.
+extern void mm_record_free(void *ptr);
+
+// Call mm_record_realloc_begin before reallocating ptr and pass what it
+// returned to mm_record_realloc_end with the result, NULL if the
+// reallocation failed and ptr is still live.
+extern unsigned long long mm_record_realloc_begin(void *ptr);
+extern void mm_record_realloc_end(unsigned long long object, void *old, void *ptr, size_t size);
+
+#endif /* _MM_RECORD_H_ */
@@ -0,0 +1,10 @@
+#ifndef _PERF_COUNTER_H_
+#define _PERF_COUNTER_H_
+
+// Hardware counter for dTLB load misses, counted across all threads
+// created after the counter is opened. Returns -1 if perf events are
+// not available (e.g. restricted by perf_event_paranoid).
+extern int dtlb_counter_open(void);
+extern long long dtlb_counter_read(int fd);
+
+#endif /* _PERF_COUNTER_H_ */
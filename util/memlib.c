@@ -28,42 +28,112 @@ static int page_size;
 
 
 
+/* Pages are committed a transparent huge page at a time as the break grows */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#define COMMIT_CHUNK HUGE_PAGE_SIZE
+
+static char *dseg_committed;  /* End of the part of the reservation that is readable and writable */
+static int populate_commits;  /* Prefault committed memory (MEMLIB_POPULATE) */
+static int use_hugepages;     /* Back committed memory with huge pages (MEMLIB_HUGEPAGES) */
+
 int mem_init (void)
 {
 
     /* Get system page size */
     page_size = (int) getpagesize();
-
-    /* Allocate heap */
-    dseg_lo = (char *) malloc(DSEG_MAX + 2*page_size);
-    if (!dseg_lo)
+    populate_commits = getenv("MEMLIB_POPULATE") != NULL;
+    use_hugepages = getenv("MEMLIB_HUGEPAGES") != NULL;
+
+    /* Reserve the address space for the whole heap up front without
+     * backing it, then commit it as the break moves.  The reservation
+     * is mapped directly rather than through malloc, so that an
+     * allocator interposing malloc can call this, and it is zero filled
+     * so mem_sbrk always hands out zeroed memory.  Fall back to smaller
+     * reservations when the address space is limited.  The start is
+     * aligned to a huge page so that commits line up with them. */
+    for (dseg_size = DSEG_MAX; dseg_size >= DSEG_MIN; dseg_size /= 2) {
+        dseg_lo = (char *) mmap(NULL, dseg_size + HUGE_PAGE_SIZE, PROT_NONE,
+                                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (dseg_lo != MAP_FAILED)
+            break;
+    }
+    if (dseg_lo == MAP_FAILED) {
+        dseg_lo = NULL;
         return -1;
+    }
+
+    dseg_lo = (char *) (((unsigned long) dseg_lo + HUGE_PAGE_SIZE - 1) & ~(unsigned long) (HUGE_PAGE_SIZE - 1));
 
-    /* align heap to the next page boundary */
-    dseg_lo = (char *) PAGE_ALIGN_UP(dseg_lo);
     dseg_hi = dseg_lo-1;
-    dseg_size = DSEG_MAX;
+    dseg_committed = dseg_lo;
 
 
     return 0;
 }
 
 
-void *mem_sbrk (ptrdiff_t increment)
+/* Make the reservation accessible up to at least end.  Racing callers
+ * may commit overlapping ranges, which is harmless, and dseg_committed
+ * only moves past memory whose mprotect has completed. */
+static int mem_commit (char *end)
+{
+    char *committed = __atomic_load_n(&dseg_committed, __ATOMIC_ACQUIRE);
+    char *target;
+
+    while (committed < end) {
+        target = dseg_lo + ((end - dseg_lo + COMMIT_CHUNK - 1) / COMMIT_CHUNK) * COMMIT_CHUNK;
+        if (target > dseg_lo + dseg_size)
+            target = dseg_lo + dseg_size;
+
+        if (mprotect(committed, target - committed, PROT_READ | PROT_WRITE) != 0)
+            return -1;
+        if (use_hugepages)
+            madvise(committed, target - committed, MADV_HUGEPAGE);
+#ifdef MADV_POPULATE_WRITE
+        if (populate_commits)
+            madvise(committed, target - committed, MADV_POPULATE_WRITE);
+#endif
+
+        if (__atomic_compare_exchange_n(&dseg_committed, &committed, target, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+            break;
+    }
+
+    return 0;
+}
+
+
+/* Lock free: concurrent callers race to move the break with a
+ * compare and swap, so each of them gets a disjoint range.  The range
+ * starts at the next multiple of alignment (a power of two), any gap
+ * before it is skipped. */
+void *mem_sbrk_aligned (ptrdiff_t increment, size_t alignment)
 {
-    char *new_hi = dseg_hi + increment;
-    char *old_hi = dseg_hi;
-    long dseg_cursize = dseg_hi - dseg_lo + 1;
+    char *old_hi = __atomic_load_n(&dseg_hi, __ATOMIC_RELAXED);
+    char *start, *new_hi;
 
     assert(increment > 0);
 
-    /* Resize data segment, if the memory is available */
-    if (new_hi > dseg_lo + dseg_size)
+    do {
+        start = (char *) (((unsigned long) old_hi + alignment) & ~(unsigned long) (alignment - 1));
+        new_hi = start + increment - 1;
+
+        /* Resize data segment, if the memory is available */
+        if (new_hi >= dseg_lo + dseg_size)
+            return NULL;
+    } while (!__atomic_compare_exchange_n(&dseg_hi, &old_hi, new_hi, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    /* The range stays allocated if this fails, like any other leak */
+    if (mem_commit(new_hi + 1) != 0)
         return NULL;
-    dseg_hi = new_hi;
-    dseg_cursize = dseg_hi - dseg_lo + 1;
 
-    return (void *)(old_hi + 1);
+    return (void *) start;
+}
+
+void *mem_sbrk (ptrdiff_t increment)
+{
+    return mem_sbrk_aligned(increment, 1);
 }
 
 int mem_pagesize (void)
@@ -71,6 +141,12 @@ int mem_pagesize (void)
     return page_size;
 }
 
+/* Size of the huge pages backing the heap, or 0 when they are not used */
+size_t mem_hugepage_size (void)
+{
+    return use_hugepages ? HUGE_PAGE_SIZE : 0;
+}
+
 ptrdiff_t mem_usage (void)
 {
   /* hack for libc */
@@ -80,3 +156,31 @@ ptrdiff_t mem_usage (void)
   return dseg_hi - dseg_lo;
 }
  
+
+/* Give the physical pages behind a page aligned range of the data
+ * segment back to the OS.  The range stays mapped, it reads as zero
+ * (or as its old contents with MADV_FREE) until it is touched again.
+ */
+int mem_release (void *ptr, size_t len, int advice)
+{
+    assert(ptr == PAGE_ALIGN(ptr) && len % page_size == 0);
+
+    if (len == 0)
+        return 0;
+    return madvise(ptr, len, advice);
+}
+
+/* Resident set size of the whole process, in bytes */
+long mem_rss (void)
+{
+    long size, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+
+    if (statm == NULL)
+        return -1;
+    if (fscanf(statm, "%ld %ld", &size, &resident) != 2)
+        resident = -1;
+    fclose(statm);
+
+    return resident < 0 ? -1 : resident * getpagesize();
+}
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "mm_lock.h"
+
+static const char *path_names[MM_LOCK_NUM_PATHS] = {
+	"small alloc", "small free", "large alloc", "large free", "sbrk", "maintenance"
+};
+
+static mm_lock_t *registered_locks;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+__thread unsigned long long mm_lock_thread_wait_ticks;
+
+static unsigned long long read_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+// bucket b counts durations in [2^(b-1), 2^b) ticks, the last one everything longer
+static unsigned int histogram_bucket(unsigned long long ticks) {
+	unsigned int bucket = (ticks == 0) ? 0 : 64 - __builtin_clzll(ticks);
+	return (bucket < MM_LOCK_HISTOGRAM_BUCKETS) ? bucket : MM_LOCK_HISTOGRAM_BUCKETS - 1;
+}
+
+static void lock_registry(void) {
+	pthread_mutex_lock(&registry_lock);
+}
+
+static void unlock_registry(void) {
+	pthread_mutex_unlock(&registry_lock);
+}
+
+static void initialize_registry(void) {
+	// a fork must not leave the registry locked in the child
+	pthread_atfork(lock_registry, unlock_registry, unlock_registry);
+
+	if (getenv("MM_LOCK_PROFILE") != NULL) {
+		atexit(mm_lock_report);
+	}
+}
+
+void mm_lock_init(mm_lock_t *lock, const char *name) {
+	pthread_once(&registry_once, initialize_registry);
+
+	memset(lock, 0, sizeof(mm_lock_t));
+	pthread_mutex_init(&lock->mutex, NULL);
+	strncpy(lock->name, name, MM_LOCK_NAME_LENGTH - 1);
+
+	pthread_mutex_lock(&registry_lock);
+	lock->next = registered_locks;
+	if (registered_locks != NULL) {
+		registered_locks->prev = lock;
+	}
+	registered_locks = lock;
+	lock->registered = 1;
+	pthread_mutex_unlock(&registry_lock);
+}
+
+void mm_lock_destroy(mm_lock_t *lock) {
+	if (lock->registered) {
+		pthread_mutex_lock(&registry_lock);
+		if (lock->prev != NULL) {
+			lock->prev->next = lock->next;
+		} else {
+			registered_locks = lock->next;
+		}
+		if (lock->next != NULL) {
+			lock->next->prev = lock->prev;
+		}
+		pthread_mutex_unlock(&registry_lock);
+	}
+
+	pthread_mutex_destroy(&lock->mutex);
+}
+
+void mm_lock_acquire(mm_lock_t *lock, enum mm_lock_path path) {
+	unsigned long long wait = 0;
+	int contended = 0;
+
+	if (pthread_mutex_trylock(&lock->mutex) != 0) {
+		unsigned long long start = read_ticks();
+		pthread_mutex_lock(&lock->mutex);
+		wait = read_ticks() - start;
+		contended = 1;
+		mm_lock_thread_wait_ticks += wait;
+	}
+
+	lock->acquired_at = 0;
+	if ((lock->acquisitions[path] & (MM_LOCK_HOLD_SAMPLING - 1)) == 0) {
+		lock->acquired_at = read_ticks();
+	}
+	lock->path = path;
+	lock->acquisitions[path]++;
+	lock->contended[path] += contended;
+	lock->wait_ticks[path] += wait;
+	lock->wait_histogram[histogram_bucket(wait)]++;
+}
+
+void mm_lock_release(mm_lock_t *lock) {
+	if (lock->acquired_at != 0) {
+		unsigned long long hold = read_ticks() - lock->acquired_at;
+
+		lock->hold_samples[lock->path]++;
+		lock->hold_ticks[lock->path] += hold;
+		lock->hold_histogram[histogram_bucket(hold)]++;
+	}
+
+	pthread_mutex_unlock(&lock->mutex);
+}
+
+unsigned long long mm_lock_ticks(void) {
+	return read_ticks();
+}
+
+static void print_histogram(const char *label, unsigned long long *histogram) {
+	fprintf(stderr, "  %s ticks:", label);
+	for (unsigned int i = 0; i < MM_LOCK_HISTOGRAM_BUCKETS; i++) {
+		if (histogram[i] != 0) {
+			fprintf(stderr, " <2^%u:%llu", i, histogram[i]);
+		}
+	}
+	fprintf(stderr, "\n");
+}
+
+void mm_lock_report(void) {
+	pthread_mutex_lock(&registry_lock);
+
+	for (mm_lock_t *lock = registered_locks; lock != NULL; lock = lock->next) {
+		unsigned long long acquisitions = 0, contended = 0;
+		for (unsigned int p = 0; p < MM_LOCK_NUM_PATHS; p++) {
+			acquisitions += lock->acquisitions[p];
+			contended += lock->contended[p];
+		}
+		if (acquisitions == 0) {
+			continue;
+		}
+
+		fprintf(stderr, "lock %s: %llu acquisitions, %llu contended (%.2f%%)\n",
+			lock->name, acquisitions, contended, 100.0 * contended / acquisitions);
+		fprintf(stderr, "  %-12s %14s %12s %14s %14s\n",
+			"path", "acquisitions", "contended", "avg wait", "avg hold");
+
+		for (unsigned int p = 0; p < MM_LOCK_NUM_PATHS; p++) {
+			if (lock->acquisitions[p] == 0) {
+				continue;
+			}
+			fprintf(stderr, "  %-12s %14llu %12llu %14.1f %14.1f\n", path_names[p],
+				lock->acquisitions[p], lock->contended[p],
+				(double)lock->wait_ticks[p] / lock->acquisitions[p],
+				(double)lock->hold_ticks[p] / lock->hold_samples[p]);
+		}
+
+		print_histogram("wait", lock->wait_histogram);
+		print_histogram("sampled hold", lock->hold_histogram);
+	}
+
+	pthread_mutex_unlock(&registry_lock);
+}
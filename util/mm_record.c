@@ -0,0 +1,417 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "mm_record.h"
+
+#define BUFFER_EVENTS 4096   // events a thread collects before writing them out
+#define NUM_STRIPES 64       // address tables, each with its own lock
+#define STRIPE_SLOTS 4096    // initial slots of an address table, power of two
+#define MAX_THREADS (1 << 14)
+
+// Threads append to their own buffer; the lock only keeps mm_record_stop
+// from flushing a buffer while its thread is appending to it.
+typedef struct thread_buffer {
+	pthread_mutex_t lock;
+	struct thread_buffer *prev;
+	struct thread_buffer *next;
+	unsigned int thread;
+	unsigned int count;
+	mm_record_event_t events[BUFFER_EVENTS];
+} thread_buffer_t;
+
+typedef struct object_slot {
+	void *ptr; // NULL if the slot is empty
+	unsigned long long object;
+} object_slot_t;
+
+// Open addressing table from live addresses to object numbers, kept at
+// most half full.
+typedef struct object_stripe {
+	pthread_mutex_t lock;
+	object_slot_t *slots;
+	unsigned long capacity;
+	unsigned long count;
+} __attribute__((aligned(64))) object_stripe_t;
+
+int mm_recording;
+
+static int trace_fd = -1;
+static pthread_mutex_t file_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec start_time;
+static unsigned long long next_seq;
+static object_stripe_t stripes[NUM_STRIPES];
+
+static pthread_key_t buffer_key;
+static thread_buffer_t *registered_buffers;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int free_threads[MAX_THREADS];
+static unsigned int num_free_threads;
+static unsigned int num_threads;
+
+static __thread thread_buffer_t *thread_buffer;
+
+static void *map_pages(size_t size) {
+	void *pages = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	return (pages == MAP_FAILED) ? NULL : pages;
+}
+
+static unsigned long long elapsed_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start_time.tv_sec) * 1000000000ULL + now.tv_nsec - start_time.tv_nsec;
+}
+
+static void write_events(const void *data, size_t size) {
+	const char *next = data;
+
+	pthread_mutex_lock(&file_lock);
+	while (trace_fd >= 0 && size > 0) {
+		ssize_t written = write(trace_fd, next, size);
+		if (written <= 0) {
+			break;
+		}
+		next += written;
+		size -= written;
+	}
+	pthread_mutex_unlock(&file_lock);
+}
+
+// Called with the buffer locked.
+static void flush_buffer(thread_buffer_t *buffer) {
+	if (buffer->count > 0) {
+		write_events(buffer->events, buffer->count * sizeof(mm_record_event_t));
+		buffer->count = 0;
+	}
+}
+
+// Runs at thread exit: writes out what is left and hands the thread
+// number to the next new thread, so that numbers stay dense.
+static void release_buffer(void *arg) {
+	thread_buffer_t *buffer = arg;
+
+	pthread_mutex_lock(&buffer->lock);
+	flush_buffer(buffer);
+	pthread_mutex_unlock(&buffer->lock);
+
+	pthread_mutex_lock(&registry_lock);
+	if (buffer->prev != NULL) {
+		buffer->prev->next = buffer->next;
+	} else {
+		registered_buffers = buffer->next;
+	}
+	if (buffer->next != NULL) {
+		buffer->next->prev = buffer->prev;
+	}
+	// threads sharing a number give it back once each, so the list can fill up
+	if (num_free_threads < MAX_THREADS) {
+		free_threads[num_free_threads++] = buffer->thread;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_mutex_destroy(&buffer->lock);
+	munmap(buffer, sizeof(thread_buffer_t));
+	thread_buffer = NULL;
+}
+
+static thread_buffer_t *claim_buffer(void) {
+	thread_buffer_t *buffer = map_pages(sizeof(thread_buffer_t));
+	if (buffer == NULL) {
+		return NULL;
+	}
+	pthread_mutex_init(&buffer->lock, NULL);
+
+	pthread_mutex_lock(&registry_lock);
+	if (num_free_threads > 0) {
+		buffer->thread = free_threads[--num_free_threads];
+	} else {
+		// past MAX_THREADS live threads, numbers are shared
+		buffer->thread = num_threads++ & (MAX_THREADS - 1);
+	}
+	buffer->next = registered_buffers;
+	if (registered_buffers != NULL) {
+		registered_buffers->prev = buffer;
+	}
+	registered_buffers = buffer;
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_setspecific(buffer_key, buffer);
+	thread_buffer = buffer;
+	return buffer;
+}
+
+static void append_event(unsigned long long seq, enum mm_record_op op,
+		unsigned long long object, size_t size) {
+	thread_buffer_t *buffer = thread_buffer;
+	if (buffer == NULL && (buffer = claim_buffer()) == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&buffer->lock);
+	mm_record_event_t *event = &buffer->events[buffer->count++];
+	event->seq = seq;
+	event->timestamp = elapsed_ns();
+	event->object = object;
+	event->size = size;
+	event->thread = buffer->thread;
+	event->op = op;
+	if (buffer->count == BUFFER_EVENTS) {
+		flush_buffer(buffer);
+	}
+	pthread_mutex_unlock(&buffer->lock);
+}
+
+static unsigned long long take_seq(void) {
+	return __atomic_fetch_add(&next_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+static unsigned long hash_address(void *ptr) {
+	return ((uintptr_t)ptr >> 4) * 0x9e3779b97f4a7c15ULL >> 20;
+}
+
+static object_stripe_t *lock_stripe(void *ptr) {
+	object_stripe_t *stripe = &stripes[hash_address(ptr) & (NUM_STRIPES - 1)];
+	pthread_mutex_lock(&stripe->lock);
+	return stripe;
+}
+
+static unsigned long home_slot(object_stripe_t *stripe, void *ptr) {
+	return (hash_address(ptr) / NUM_STRIPES) & (stripe->capacity - 1);
+}
+
+static void place_object(object_stripe_t *stripe, void *ptr, unsigned long long object) {
+	unsigned long i = home_slot(stripe, ptr);
+	while (stripe->slots[i].ptr != NULL && stripe->slots[i].ptr != ptr) {
+		i = (i + 1) & (stripe->capacity - 1);
+	}
+	if (stripe->slots[i].ptr == NULL) {
+		stripe->count++;
+	}
+	stripe->slots[i].ptr = ptr;
+	stripe->slots[i].object = object;
+}
+
+static int grow_stripe(object_stripe_t *stripe) {
+	unsigned long capacity = stripe->capacity ? stripe->capacity * 2 : STRIPE_SLOTS;
+	object_slot_t *old = stripe->slots;
+	unsigned long old_capacity = stripe->capacity;
+
+	object_slot_t *slots = map_pages(capacity * sizeof(object_slot_t));
+	if (slots == NULL) {
+		return -1;
+	}
+
+	stripe->slots = slots;
+	stripe->capacity = capacity;
+	stripe->count = 0;
+	for (unsigned long i = 0; i < old_capacity; i++) {
+		if (old[i].ptr != NULL) {
+			place_object(stripe, old[i].ptr, old[i].object);
+		}
+	}
+	if (old != NULL) {
+		munmap(old, old_capacity * sizeof(object_slot_t));
+	}
+	return 0;
+}
+
+// Called with the stripe locked.
+static void insert_object(object_stripe_t *stripe, void *ptr, unsigned long long object) {
+	if (2 * (stripe->count + 1) > stripe->capacity && grow_stripe(stripe) != 0) {
+		return;
+	}
+	place_object(stripe, ptr, object);
+}
+
+// Called with the stripe locked. Returns 0 if ptr is not in the table,
+// which happens for memory allocated before recording started.
+static int remove_object(object_stripe_t *stripe, void *ptr, unsigned long long *object) {
+	if (stripe->capacity == 0) {
+		return 0;
+	}
+
+	unsigned long mask = stripe->capacity - 1;
+	unsigned long i = home_slot(stripe, ptr);
+	while (stripe->slots[i].ptr != ptr) {
+		if (stripe->slots[i].ptr == NULL) {
+			return 0;
+		}
+		i = (i + 1) & mask;
+	}
+	*object = stripe->slots[i].object;
+
+	// shift later entries of the run back so that lookups need no tombstones
+	unsigned long hole = i;
+	for (unsigned long j = (i + 1) & mask; stripe->slots[j].ptr != NULL; j = (j + 1) & mask) {
+		unsigned long home = home_slot(stripe, stripe->slots[j].ptr);
+		if (((j - home) & mask) >= ((j - hole) & mask)) {
+			stripe->slots[hole] = stripe->slots[j];
+			hole = j;
+		}
+	}
+	stripe->slots[hole].ptr = NULL;
+	stripe->count--;
+	return 1;
+}
+
+// A forked child would write the calls of another process into the
+// trace, and copies of the parent's buffers with them, so it stops
+// recording without flushing anything.
+static void stop_in_child(void) {
+	if (mm_recording) {
+		mm_recording = 0;
+		close(trace_fd);
+		trace_fd = -1;
+	}
+	if (thread_buffer != NULL) {
+		pthread_setspecific(buffer_key, NULL);
+		thread_buffer = NULL;
+	}
+}
+
+int mm_record_start(const char *path) {
+	if (mm_recording) {
+		return -1;
+	}
+
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+
+	mm_record_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MM_RECORD_MAGIC, sizeof(header.magic));
+	header.event_size = sizeof(mm_record_event_t);
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		close(fd);
+		return -1;
+	}
+
+	static int initialized;
+	if (!initialized) {
+		for (int i = 0; i < NUM_STRIPES; i++) {
+			pthread_mutex_init(&stripes[i].lock, NULL);
+		}
+		pthread_key_create(&buffer_key, release_buffer);
+		pthread_atfork(NULL, NULL, stop_in_child);
+		atexit(mm_record_stop);
+		initialized = 1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start_time);
+	next_seq = 0;
+	trace_fd = fd;
+	__atomic_store_n(&mm_recording, 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+void mm_record_stop(void) {
+	if (!__atomic_exchange_n(&mm_recording, 0, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+
+	pthread_mutex_lock(&registry_lock);
+	for (thread_buffer_t *buffer = registered_buffers; buffer != NULL; buffer = buffer->next) {
+		pthread_mutex_lock(&buffer->lock);
+		flush_buffer(buffer);
+		pthread_mutex_unlock(&buffer->lock);
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	pthread_mutex_lock(&file_lock);
+	close(trace_fd);
+	trace_fd = -1;
+	pthread_mutex_unlock(&file_lock);
+
+	for (int i = 0; i < NUM_STRIPES; i++) {
+		pthread_mutex_lock(&stripes[i].lock);
+		if (stripes[i].slots != NULL) {
+			munmap(stripes[i].slots, stripes[i].capacity * sizeof(object_slot_t));
+		}
+		stripes[i].slots = NULL;
+		stripes[i].capacity = 0;
+		stripes[i].count = 0;
+		pthread_mutex_unlock(&stripes[i].lock);
+	}
+}
+
+void mm_record_alloc(enum mm_record_op op, void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	object_stripe_t *stripe = lock_stripe(ptr);
+	unsigned long long seq = take_seq();
+	insert_object(stripe, ptr, seq);
+	pthread_mutex_unlock(&stripe->lock);
+
+	append_event(seq, op, seq, size);
+}
+
+void mm_record_free(void *ptr) {
+	unsigned long long object;
+
+	if (ptr == NULL) {
+		return;
+	}
+
+	object_stripe_t *stripe = lock_stripe(ptr);
+	int known = remove_object(stripe, ptr, &object);
+	pthread_mutex_unlock(&stripe->lock);
+
+	if (known) {
+		append_event(take_seq(), MM_RECORD_FREE, object, 0);
+	}
+}
+
+unsigned long long mm_record_realloc_begin(void *ptr) {
+	unsigned long long object = 0;
+
+	if (ptr == NULL) {
+		return 0;
+	}
+
+	// the old address may be handed out again as soon as realloc moves
+	// the object, so it has to leave the table first
+	object_stripe_t *stripe = lock_stripe(ptr);
+	if (!remove_object(stripe, ptr, &object)) {
+		object = 0;
+	} else {
+		object++; // 0 stands for an unknown object
+	}
+	pthread_mutex_unlock(&stripe->lock);
+	return object;
+}
+
+void mm_record_realloc_end(unsigned long long object, void *old, void *ptr, size_t size) {
+	if (object == 0) {
+		// realloc(NULL, size) or of an object from before recording started
+		mm_record_alloc(MM_RECORD_MALLOC, ptr, size);
+		return;
+	}
+
+	object_stripe_t *stripe;
+	if (ptr == NULL) {
+		if (size > 0) {
+			stripe = lock_stripe(old);
+			insert_object(stripe, old, object - 1);
+			pthread_mutex_unlock(&stripe->lock);
+		} else {
+			append_event(take_seq(), MM_RECORD_FREE, object - 1, 0);
+		}
+		return;
+	}
+
+	stripe = lock_stripe(ptr);
+	unsigned long long seq = take_seq();
+	insert_object(stripe, ptr, object - 1);
+	pthread_mutex_unlock(&stripe->lock);
+
+	append_event(seq, MM_RECORD_REALLOC, object - 1, size);
+}